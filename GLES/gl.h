@@ -184,6 +184,11 @@ typedef unsigned int GLbitfield;
 #define GL_CONSTANT 20002
 #define GL_ALPHA 20003
 #define GL_NEAREST_MIPMAP_LINEAR 20004
+#define GL_NEAREST_MIPMAP_NEAREST 20005
+#define GL_LINEAR_MIPMAP_NEAREST 20006
+#define GL_UNSIGNED_SHORT_5_6_5 20007
+#define GL_UNSIGNED_SHORT_4_4_4_4 20008
+#define GL_UNSIGNED_SHORT_5_5_5_1 20009
 
 
 
@@ -235,6 +240,34 @@ typedef unsigned int GLbitfield;
 #define GL_ELEMENT_ARRAY_BUFFER       0x8893
 #endif
 
+// Buffer usage hints, identical to the ones in Neverball share/glext.h
+#ifndef GL_STATIC_DRAW
+#define GL_STATIC_DRAW                0x88E4
+#define GL_DYNAMIC_DRAW               0x88E8
+#endif
+
+// EXT_texture_compression_s3tc
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT  0x83F0
+#define GL_COMPRESSED_RGBA_S3TC_DXT1_EXT 0x83F1
+#define GL_COMPRESSED_RGBA_S3TC_DXT3_EXT 0x83F2
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+
+// OES_compressed_paletted_texture
+#ifndef GL_PALETTE4_RGB8_OES
+#define GL_PALETTE4_RGB8_OES     0x8B90
+#define GL_PALETTE4_RGBA8_OES    0x8B91
+#define GL_PALETTE4_R5_G6_B5_OES 0x8B92
+#define GL_PALETTE4_RGBA4_OES    0x8B93
+#define GL_PALETTE4_RGB5_A1_OES  0x8B94
+#define GL_PALETTE8_RGB8_OES     0x8B95
+#define GL_PALETTE8_RGBA8_OES    0x8B96
+#define GL_PALETTE8_R5_G6_B5_OES 0x8B97
+#define GL_PALETTE8_RGBA4_OES    0x8B98
+#define GL_PALETTE8_RGB5_A1_OES  0x8B99
+#endif
+
 
 
 
@@ -290,6 +323,9 @@ GL_API void GL_APIENTRY glActiveTexture (GLenum texture);
 GL_API void GL_APIENTRY glClientActiveTexture (GLenum texture);
 GL_API void GL_APIENTRY glDeleteTextures (GLsizei n, const GLuint *textures);
 GL_API void GL_APIENTRY glTexImage2D (GLenum target, GLint level, GLint internalformat, GLsizei width, GLsizei height, GLint border, GLenum format, GLenum type, const void *pixels);
+GL_API void GL_APIENTRY glTexSubImage2D (GLenum target, GLint level, GLint xoffset, GLint yoffset, GLsizei width, GLsizei height, GLenum format, GLenum type, const void *pixels);
+GL_API void GL_APIENTRY glCompressedTexImage2D (GLenum target, GLint level, GLenum internalformat, GLsizei width, GLsizei height, GLint border, GLsizei imageSize, const void *data);
+GL_API void GL_APIENTRY glCompressedTexSubImage2D (GLenum target, GLint level, GLint xoffset, GLint yoffset, GLsizei width, GLsizei height, GLenum format, GLsizei imageSize, const void *data);
 GL_API void GL_APIENTRY glTexParameteri (GLenum target, GLenum pname, GLint param);
 
 // Renderstates
@@ -318,6 +354,13 @@ GL_API void GL_APIENTRY glPointParameterfv (GLenum pname, const GLfloat *params)
 GL_API void GL_APIENTRY glPointSize (GLfloat size);
 GL_API void GL_APIENTRY glPolygonOffset (GLfloat factor, GLfloat units);
 
+// Hints
+#define GL_DONT_CARE 20010
+#define GL_FASTEST 20011
+#define GL_NICEST 20012
+#define GL_TEXTURE_DOWNCONVERT_HINT 40006
+GL_API void GL_APIENTRY glHint (GLenum target, GLenum mode);
+
 // TexEnv
 GL_API void GL_APIENTRY glTexEnvi (GLenum target, GLenum pname, GLint param);
 
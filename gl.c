@@ -3,7 +3,14 @@
 #include <stdio.h>
 
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <math.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
 
 #include <SDL.h>
 
@@ -13,6 +20,7 @@
 
 static float viewport_matrix[4*4];
 
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
 #define MAX(a, b) (((a) > (b)) ? (a) : (b))
 
 static float _max(float a, float b) {
@@ -80,7 +88,7 @@ static void _unimplemented(const char* fmt, ...) {
 #define unimplemented(fmt, ...) { \
   static bool encountered = false; \
   if (!encountered) { \
-    _unimplemented("%s (%s:%d) " fmt "\n", __FUNCTION__, __FILE__, __LINE__, __VA_ARGS__); \
+    _unimplemented("%s (%s:%d) " fmt "\n", __FUNCTION__, __FILE__, __LINE__, ##__VA_ARGS__); \
     encountered = true; \
   } \
 }
@@ -120,36 +128,484 @@ void debugPrintFloat(float f) {}
 #include <stdint.h>
 #include <string.h>
 #include <pbkit/pbkit.h>
+#include <hal/video.h>
 
 #include "GLES/gl.h"
 //#include <xgu/xgu.h>
 
 
-static void* AllocateResourceMemory(size_t size) {
+// Resources are sub-allocated from a few large contiguous regions, so small
+// objects don't each cost a kernel call and a page. Small allocations are
+// served from slabs of equally sized slots; everything else is placed into
+// the best fitting free block. Allocations which are too large for a region
+// get their own contiguous memory.
+// The bookkeeping is kept in cached memory, as reading the write-combined
+// resource memory is slow.
+// Blocks know the pointer which refers to them, so they can be moved to
+// close gaps while the GPU is idle.
 #define MAXRAM 0x03FFAFFF
-  void* addr = MmAllocateContiguousMemoryEx(size, 0, MAXRAM, 0, PAGE_READWRITE | PAGE_WRITECOMBINE);
+#define RESOURCE_REGION_SIZE (4 * 1024 * 1024)
+#define RESOURCE_MAX_REGIONS 16
+#define RESOURCE_MAX_BLOCK_SIZE (RESOURCE_REGION_SIZE / 4)
+#define RESOURCE_MIN_ALIGNMENT 16
+#define RESOURCE_SLAB_SIZE (64 * 1024)
+#define RESOURCE_MIN_SLOT_SIZE 64
+#define RESOURCE_MAX_SLOT_SIZE 4096
+#define RESOURCE_SIZE_CLASS_COUNT 7 // 64 to 4096 bytes
+#define RESOURCE_SLAB_WORDS (RESOURCE_SLAB_SIZE / RESOURCE_MIN_SLOT_SIZE / 32)
+#define RESOURCE_DEFRAGMENT_BUDGET_US 500 // Time spent moving blocks per frame
+#define RESOURCE_DEFRAGMENT_ASSUMED_RATE (64 * 1024 * 1024) // Bytes moved per second, until measured
+
+typedef struct ResourceSlab {
+  uint8_t* base;
+  unsigned int size_class;
+  unsigned int slot_count;
+  unsigned int used_count;
+  uint32_t used[RESOURCE_SLAB_WORDS];
+  struct ResourceSlab* next; // Next slab of this size class with a free slot
+} ResourceSlab;
+
+typedef struct {
+  size_t offset;
+  size_t size;
+  bool used;
+  ResourceSlab* slab; // Set if this block is split into slots
+  size_t alignment;
+  void** owner; // Pointer to this block which is patched if it moves, or NULL
+} ResourceBlock;
+
+typedef struct {
+  uint8_t* base;
+  ResourceBlock* blocks; // Sorted by offset, covering the entire region
+  unsigned int block_count;
+  unsigned int block_capacity;
+} ResourceRegion;
+
+static ResourceRegion resource_regions[RESOURCE_MAX_REGIONS];
+static unsigned int resource_region_count = 0;
+static ResourceSlab* resource_slabs[RESOURCE_SIZE_CLASS_COUNT];
+
+static void* AllocateContiguousMemory(size_t size, size_t alignment) {
+  return MmAllocateContiguousMemoryEx(size, 0, MAXRAM, alignment, PAGE_READWRITE | PAGE_WRITECOMBINE);
+}
+
+static void insert_resource_block(ResourceRegion* region, unsigned int index, size_t offset, size_t size, bool used) {
+  if (region->block_count == region->block_capacity) {
+    region->block_capacity = region->block_capacity ? (region->block_capacity * 2) : 16;
+    region->blocks = realloc(region->blocks, region->block_capacity * sizeof(ResourceBlock));
+    assert(region->blocks != NULL);
+  }
+  memmove(&region->blocks[index + 1], &region->blocks[index], (region->block_count - index) * sizeof(ResourceBlock));
+  region->blocks[index].offset = offset;
+  region->blocks[index].size = size;
+  region->blocks[index].used = used;
+  region->blocks[index].slab = NULL;
+  region->blocks[index].alignment = RESOURCE_MIN_ALIGNMENT;
+  region->blocks[index].owner = NULL;
+  region->block_count++;
+}
+
+static void remove_resource_block(ResourceRegion* region, unsigned int index) {
+  region->block_count--;
+  memmove(&region->blocks[index], &region->blocks[index + 1], (region->block_count - index) * sizeof(ResourceBlock));
+}
+
+// Finds the region and the index of the block which contains `ptr`
+static ResourceRegion* find_resource_block(const void* ptr, unsigned int* index) {
+  for(unsigned int i = 0; i < resource_region_count; i++) {
+    ResourceRegion* region = &resource_regions[i];
+    if (((const uint8_t*)ptr < region->base) || ((const uint8_t*)ptr >= &region->base[RESOURCE_REGION_SIZE])) {
+      continue;
+    }
+    size_t offset = (const uint8_t*)ptr - region->base;
+    unsigned int low = 0;
+    unsigned int high = region->block_count;
+    while(high - low > 1) {
+      unsigned int middle = (low + high) / 2;
+      if (region->blocks[middle].offset <= offset) {
+        low = middle;
+      } else {
+        high = middle;
+      }
+    }
+    *index = low;
+    return region;
+  }
+  return NULL;
+}
+
+// Takes `size` bytes from the smallest free block which can hold them
+static void* allocate_resource_block(size_t size, size_t alignment, void** owner) {
+  ResourceRegion* best_region = NULL;
+  unsigned int best_index = 0;
+  size_t best_padding = 0;
+  for(unsigned int i = 0; i < resource_region_count; i++) {
+    ResourceRegion* region = &resource_regions[i];
+    for(unsigned int j = 0; j < region->block_count; j++) {
+      const ResourceBlock* block = &region->blocks[j];
+      if (block->used) {
+        continue;
+      }
+      uintptr_t start = (uintptr_t)&region->base[block->offset];
+      size_t padding = ((start + alignment - 1) & ~(uintptr_t)(alignment - 1)) - start;
+      if (padding + size > block->size) {
+        continue;
+      }
+      if ((best_region == NULL) || (block->size < best_region->blocks[best_index].size)) {
+        best_region = region;
+        best_index = j;
+        best_padding = padding;
+      }
+    }
+  }
+
+  // Open another region if nothing fits
+  if (best_region == NULL) {
+    if (resource_region_count == RESOURCE_MAX_REGIONS) {
+      return NULL;
+    }
+    uint8_t* base = AllocateContiguousMemory(RESOURCE_REGION_SIZE, 0);
+    if (base == NULL) {
+      return NULL;
+    }
+    best_region = &resource_regions[resource_region_count++];
+    best_region->base = base;
+    best_region->blocks = NULL;
+    best_region->block_count = 0;
+    best_region->block_capacity = 0;
+    insert_resource_block(best_region, 0, 0, RESOURCE_REGION_SIZE, false);
+    best_index = 0;
+    best_padding = 0; // Regions are page aligned
+  }
+
+  // Split off the padding and the remainder as free blocks
+  ResourceBlock block = best_region->blocks[best_index];
+  if (best_padding > 0) {
+    best_region->blocks[best_index].size = best_padding;
+    best_index++;
+    insert_resource_block(best_region, best_index, block.offset + best_padding, block.size - best_padding, false);
+    block = best_region->blocks[best_index];
+  }
+  if (block.size > size) {
+    insert_resource_block(best_region, best_index + 1, block.offset + size, block.size - size, false);
+  }
+  ResourceBlock* result = &best_region->blocks[best_index];
+  result->size = size;
+  result->used = true;
+  result->alignment = alignment;
+  result->owner = owner;
+  return &best_region->base[result->offset];
+}
+
+static void free_resource_block(ResourceRegion* region, unsigned int index) {
+  ResourceBlock* block = &region->blocks[index];
+  block->used = false;
+  block->slab = NULL;
+  block->owner = NULL;
+
+  // Merge with free neighbours
+  if ((index + 1 < region->block_count) && !region->blocks[index + 1].used) {
+    block->size += region->blocks[index + 1].size;
+    remove_resource_block(region, index + 1);
+  }
+  if ((index > 0) && !region->blocks[index - 1].used) {
+    region->blocks[index - 1].size += block->size;
+    remove_resource_block(region, index);
+  }
+
+  // Return empty regions, but keep one around for the next allocations
+  if ((region->block_count == 1) && (resource_region_count > 1)) {
+    MmFreeContiguousMemory(region->base);
+    free(region->blocks);
+    *region = resource_regions[--resource_region_count];
+  }
+}
+
+static void* allocate_resource_slot(unsigned int size_class) {
+  ResourceSlab* slab = resource_slabs[size_class];
+  unsigned int slot_size = RESOURCE_MIN_SLOT_SIZE << size_class;
+
+  // Carve a new slab if all are full
+  if (slab == NULL) {
+    uint8_t* base = allocate_resource_block(RESOURCE_SLAB_SIZE, slot_size, NULL);
+    if (base == NULL) {
+      return NULL;
+    }
+    unsigned int index;
+    ResourceRegion* region = find_resource_block(base, &index);
+    slab = calloc(1, sizeof(ResourceSlab));
+    assert(slab != NULL);
+    slab->base = base;
+    slab->size_class = size_class;
+    slab->slot_count = RESOURCE_SLAB_SIZE / slot_size;
+    region->blocks[index].slab = slab;
+    resource_slabs[size_class] = slab;
+  }
+
+  // Take the first free slot
+  unsigned int slot = 0;
+  for(unsigned int i = 0; i < RESOURCE_SLAB_WORDS; i++) {
+    if (~slab->used[i] != 0) {
+      slot = i * 32 + __builtin_ctz(~slab->used[i]);
+      break;
+    }
+  }
+  assert(slot < slab->slot_count);
+  slab->used[slot / 32] |= 1 << (slot % 32);
+  slab->used_count++;
+  if (slab->used_count == slab->slot_count) {
+    resource_slabs[size_class] = slab->next;
+    slab->next = NULL;
+  }
+  return &slab->base[slot * slot_size];
+}
+
+static void free_resource_slot(ResourceRegion* region, unsigned int index, const void* ptr) {
+  ResourceSlab* slab = region->blocks[index].slab;
+  unsigned int slot_size = RESOURCE_MIN_SLOT_SIZE << slab->size_class;
+  unsigned int slot = ((const uint8_t*)ptr - slab->base) / slot_size;
+  assert(&slab->base[slot * slot_size] == ptr);
+  assert(slab->used[slot / 32] & (1 << (slot % 32)));
+  slab->used[slot / 32] &= ~(1 << (slot % 32));
+
+  // Full slabs are not in the list, so they have to be added again
+  if (slab->used_count == slab->slot_count) {
+    slab->next = resource_slabs[slab->size_class];
+    resource_slabs[slab->size_class] = slab;
+  }
+  slab->used_count--;
+
+  // Return empty slabs to the region
+  if (slab->used_count == 0) {
+    ResourceSlab** link = &resource_slabs[slab->size_class];
+    while(*link != slab) {
+      link = &(*link)->next;
+    }
+    *link = slab->next;
+    free(slab);
+    free_resource_block(region, index);
+  }
+}
+
+// `owner` is where the caller stores the pointer; larger allocations might be
+// moved, and the owner will then be updated
+static bool reclaim_retired_resources();
+
+static void* AllocateResourceMemory(size_t size, size_t alignment, void** owner) {
+  alignment = MAX(alignment, RESOURCE_MIN_ALIGNMENT);
+  assert((alignment & (alignment - 1)) == 0);
+  size = (size + RESOURCE_MIN_ALIGNMENT - 1) & ~(size_t)(RESOURCE_MIN_ALIGNMENT - 1);
+
+  // Small allocations are served from slots, which are aligned to their size
+  size_t slot_size = MAX(size, alignment);
+  if (slot_size <= RESOURCE_MAX_SLOT_SIZE) {
+    unsigned int size_class = 0;
+    while((RESOURCE_MIN_SLOT_SIZE << size_class) < slot_size) {
+      size_class++;
+    }
+    void* addr = allocate_resource_slot(size_class);
+    if (addr != NULL) {
+      return addr;
+    }
+  } else if (size <= RESOURCE_MAX_BLOCK_SIZE) {
+    void* addr = allocate_resource_block(size, alignment, owner);
+    if (addr != NULL) {
+      return addr;
+    }
+  }
+
+  // Large allocations, or everything once the regions are exhausted
+  void* addr = AllocateContiguousMemory(size, (alignment > PAGE_SIZE) ? alignment : 0);
+  if ((addr == NULL) && reclaim_retired_resources()) {
+    return AllocateResourceMemory(size, alignment, owner);
+  }
   assert(addr != NULL);
   return addr;
 }
 
 static void FreeResourceMemory(void* ptr) {
-  MmFreeContiguousMemory(ptr);
+  unsigned int index;
+  ResourceRegion* region = find_resource_block(ptr, &index);
+  if (region == NULL) {
+    MmFreeContiguousMemory(ptr);
+    return;
+  }
+  ResourceBlock* block = &region->blocks[index];
+  if (block->slab != NULL) {
+    free_resource_slot(region, index, ptr);
+    return;
+  }
+  assert(block->used);
+  assert(&region->base[block->offset] == ptr);
+  free_resource_block(region, index);
+}
+
+// Pins the memory, because the owner no longer refers to it
+static void disown_resource_memory(void* ptr) {
+  unsigned int index;
+  ResourceRegion* region = find_resource_block(ptr, &index);
+  if ((region == NULL) || (region->blocks[index].slab != NULL)) {
+    return;
+  }
+  assert(&region->base[region->blocks[index].offset] == ptr);
+  region->blocks[index].owner = NULL;
+}
+
+// Moves `size` bytes to a lower address in resource memory. Reading from
+// write-combined memory is uncached, so the copy uses the widest loads
+// available to keep the number of bus reads low, and stores which bypass the
+// cache; the source is read ahead of the overlapping destination.
+static void move_resource_memory(uint8_t* dst, const uint8_t* src, size_t size) {
+  assert(dst < src);
+#ifdef __SSE__
+  assert((((uintptr_t)dst | (uintptr_t)src | size) & (RESOURCE_MIN_ALIGNMENT - 1)) == 0);
+  assert((size_t)(src - dst) >= RESOURCE_MIN_ALIGNMENT);
+  for(size_t i = 0; i < size; i += 16) {
+    _mm_stream_ps((float*)&dst[i], _mm_load_ps((const float*)&src[i]));
+  }
+  _mm_sfence();
+#else
+  memmove(dst, src, size);
+#endif
+}
+
+// Slides movable blocks into the free space in front of them, as long as the
+// move is expected to fit into the remaining `budget` ticks of the
+// performance counter. Must only be called while the GPU is idle. Returns
+// true if anything was moved.
+static bool defragment_resource_memory(ULONGLONG budget) {
+  // Ticks it takes to move 1 KiB, refined by every move
+  static ULONGLONG ticks_per_kib = 0;
+  if (ticks_per_kib == 0) {
+    ticks_per_kib = (KeQueryPerformanceFrequency() * 1024ULL) / RESOURCE_DEFRAGMENT_ASSUMED_RATE + 1;
+  }
+
+  ULONGLONG start_time = KeQueryPerformanceCounter();
+  bool moved = false;
+  for(unsigned int i = 0; i < resource_region_count; i++) {
+    ResourceRegion* region = &resource_regions[i];
+    for(unsigned int j = 1; j < region->block_count; j++) {
+      ULONGLONG elapsed = KeQueryPerformanceCounter() - start_time;
+      if (elapsed >= budget) {
+        return moved;
+      }
+
+      // Only blocks with an owner can move, slabs stay in place
+      const ResourceBlock* gap = &region->blocks[j - 1];
+      const ResourceBlock* block = &region->blocks[j];
+      if (gap->used || !block->used || (block->owner == NULL)) {
+        continue;
+      }
+      uintptr_t gap_start = (uintptr_t)&region->base[gap->offset];
+      size_t padding = ((gap_start + block->alignment - 1) & ~(uintptr_t)(block->alignment - 1)) - gap_start;
+      if (padding >= gap->size) {
+        continue;
+      }
+
+      // Leave blocks which would overrun the budget for a later frame
+      size_t size = block->size;
+      if (((size * ticks_per_kib + 1023) / 1024) > (budget - elapsed)) {
+        continue;
+      }
+
+      size_t offset = gap->offset + padding;
+      size_t freed_size = block->offset - offset;
+      ULONGLONG move_start = KeQueryPerformanceCounter();
+      move_resource_memory(&region->base[offset], &region->base[block->offset], size);
+      ULONGLONG move_duration = KeQueryPerformanceCounter() - move_start;
+      ticks_per_kib = MAX((ticks_per_kib * 3 + (move_duration * 1024) / size) / 4, 1);
+      *block->owner = &region->base[offset];
+      moved = true;
+
+      // The free space is now behind the block
+      region->blocks[j - 1].size = padding;
+      region->blocks[j].offset = offset;
+      insert_resource_block(region, j + 1, offset + size, freed_size, false);
+      if ((j + 2 < region->block_count) && !region->blocks[j + 2].used) {
+        region->blocks[j + 1].size += region->blocks[j + 2].size;
+        remove_resource_block(region, j + 2);
+      }
+      if (padding == 0) {
+        remove_resource_block(region, j - 1);
+        j--;
+      }
+    }
+  }
+  return moved;
+}
+
+// Reports how much of the regions is free, and how much of that is usable by
+// a single allocation
+static void get_resource_memory_stats(size_t* region_size, size_t* free_size, size_t* largest_free_size) {
+  *region_size = resource_region_count * RESOURCE_REGION_SIZE;
+  *free_size = 0;
+  *largest_free_size = 0;
+  for(unsigned int i = 0; i < resource_region_count; i++) {
+    const ResourceRegion* region = &resource_regions[i];
+    for(unsigned int j = 0; j < region->block_count; j++) {
+      const ResourceBlock* block = &region->blocks[j];
+      if (block->used) {
+        continue;
+      }
+      *free_size += block->size;
+      *largest_free_size = MAX(*largest_free_size, block->size);
+    }
+  }
 }
 
+// Position in the pushbuffer, counted from the start across all laps
+typedef uint64_t Fence;
+
+// Replaces pb_end(), checks that the words fit into the reserved space
+static void pb_commit(uint32_t* p);
+
+typedef enum {
+  OBJECT_TYPE_NONE,
+  OBJECT_TYPE_BUFFER,
+  OBJECT_TYPE_TEXTURE,
+  OBJECT_TYPE_COUNT
+} ObjectType;
+
 typedef struct {
   void* data;
+  ObjectType type;
+  GLuint next_unused; // Next slot in the list of unused slots, only valid while `data` is NULL
 } Object;
 
+// Range of the indices in `count` 16-bit indices at `offset` of a buffer
+typedef struct {
+  size_t offset;
+  GLsizei count; // 0 if the entry is unused
+  uint16_t min_index;
+  uint16_t max_index;
+} IndexRange;
+#define BUFFER_INDEX_RANGES 4
+
 typedef struct {
   uint8_t* data;
   size_t size;
+  size_t capacity; // Allocated size of `data`
+  IndexRange index_ranges[BUFFER_INDEX_RANGES]; // Cached for draws from this buffer
+  unsigned int next_index_range; // Entry which is replaced next
+  GLenum usage;
+  bool used; // `data` was used by a draw since it was allocated
+  Fence use_fence; // Position before the last draw which used it
 } Buffer;
+#define BUFFER_ALIGNMENT 16
 #define DEFAULT_BUFFER() \
   { \
     .data = NULL, \
-    .size = 0 \
+    .size = 0, \
+    .capacity = 0, \
+    .index_ranges = { { 0 } }, \
+    .next_index_range = 0, \
+    .usage = GL_STATIC_DRAW, \
+    .used = false, \
+    .use_fence = 0 \
   }
 
+#define TEXTURE_MAX_LEVELS 13
+
 typedef struct {
   GLsizei width;
   unsigned int width_shift;
@@ -157,11 +613,26 @@ typedef struct {
   unsigned int height_shift;
   size_t pitch;
   void* data;
+  size_t data_size; // Allocated size of `data`, can be larger than the mipmap chain
   GLint min_filter;
   GLint mag_filter;
   GLint wrap_s;
   GLint wrap_t;
   GLenum internal_base_format;
+  GLenum type; // Type of the texels from the application
+  unsigned int format; // XGU texture format
+  unsigned int compressed_block_size; // Bytes per 4x4 block, 0 if not compressed
+  unsigned int bytes_per_pixel; // 0 if compressed
+  bool linear; // Not swizzled, used for sizes which are not a power of two
+  uint32_t* palette; // 256 A8R8G8B8 entries, only allocated for paletted textures
+  bool downconverted; // RGB8/RGBA8 uploads are stored at 16 bits
+  unsigned int dropped_levels; // Levels from the application which were dropped
+  size_t level_saved_size[TEXTURE_MAX_LEVELS]; // Bytes saved by downconverting each stored level
+  bool generate_mipmap;
+  bool explicit_mipmaps; // Levels above 0 were supplied by the application
+  uint32_t level_mask; // Levels in `data` which contain valid texels
+  bool sampled; // `data` and `palette` were used by a draw since they were allocated
+  Fence sample_fence; // Position before the last draw which used them
 } Texture;
 
 typedef struct {
@@ -175,30 +646,95 @@ typedef struct {
   GLenum src_operand_alpha[3];
 } TexEnv;
 
+// Records of one type are packed into slabs which are never moved or freed,
+// so pointers to a record stay valid for the lifetime of its object
+#define OBJECT_POOL_SLAB_RECORDS 64
+
+typedef struct {
+  size_t record_size;
+  void* unused_records; // Linked through the first bytes of each record
+} ObjectPool;
+
+static ObjectPool object_pools[OBJECT_TYPE_COUNT] = {
+  [OBJECT_TYPE_BUFFER] = { .record_size = sizeof(Buffer), .unused_records = NULL },
+  [OBJECT_TYPE_TEXTURE] = { .record_size = sizeof(Texture), .unused_records = NULL },
+};
+
+static void* allocate_pool_record(ObjectPool* pool) {
+  assert(pool->record_size >= sizeof(void*));
+
+  // Records of a new slab are handed out in address order
+  if (pool->unused_records == NULL) {
+    uint8_t* slab = malloc(pool->record_size * OBJECT_POOL_SLAB_RECORDS);
+    assert(slab != NULL);
+    for(int i = OBJECT_POOL_SLAB_RECORDS - 1; i >= 0; i--) {
+      void* record = &slab[i * pool->record_size];
+      *(void**)record = pool->unused_records;
+      pool->unused_records = record;
+    }
+  }
+
+  void* record = pool->unused_records;
+  pool->unused_records = *(void**)record;
+  return record;
+}
+
+static void free_pool_record(ObjectPool* pool, void* record) {
+  *(void**)record = pool->unused_records;
+  pool->unused_records = record;
+}
+
+#define NO_OBJECT ((GLuint)-1)
+
 //FIXME: Allow different pools
 static Object* objects = NULL;
 static GLuint object_count = 0;
+static GLuint object_capacity = 0;
+static GLuint unused_objects = NO_OBJECT; // Most recently deleted slot
+
+// Grows the table geometrically, so it can take `n` more objects
+static void reserve_objects(GLuint n) {
+  if (object_count + n <= object_capacity) {
+    return;
+  }
+  object_capacity = MAX(MAX(object_capacity * 2, object_count + n), 64);
+  objects = realloc(objects, sizeof(Object) * object_capacity);
+  assert(objects != NULL);
+}
 
 static GLuint unused_object() {
-  //FIXME: Find object slot where data is NULL
-  object_count += 1;
-  objects = realloc(objects, sizeof(Object) * object_count);
-  return object_count - 1;
+
+  // Names of deleted objects are reused first
+  if (unused_objects != NO_OBJECT) {
+    GLuint index = unused_objects;
+    unused_objects = objects[index].next_unused;
+    return index;
+  }
+
+  reserve_objects(1);
+  return object_count++;
 }
 
-static void gen_objects(GLsizei n, GLuint* indices, const void* data, size_t size) {
+static void gen_objects(GLsizei n, GLuint* indices, ObjectType type, const void* data) {
+  ObjectPool* pool = &object_pools[type];
+
+
+  // Grow the table at most once for the entire batch
+  reserve_objects(n);
+
   for(int i = 0; i < n; i++) {
     GLuint index = unused_object();
 
     Object* object = &objects[index];
-    object->data = malloc(size);
-    memcpy(object->data, data, size);
+    object->data = allocate_pool_record(pool);
+    object->type = type;
+    memcpy(object->data, data, pool->record_size);
 
     indices[i] = 1 + index;
   }
 }
 
-static void del_objects(GLsizei n, const GLuint* indices) {
+static void del_objects(GLsizei n, const GLuint* indices, ObjectType type) {
   for(int i = 0; i < n; i++) {
 
     //FIXME: Also ignore non-existing names
@@ -213,11 +749,32 @@ static void del_objects(GLsizei n, const GLuint* indices) {
     //FIXME: Call a handler routine?
 
     assert(object->data != NULL);
-    free(object->data);
+    assert(object->type == type);
+    free_pool_record(&object_pools[type], object->data);
     object->data = NULL;
+    object->type = OBJECT_TYPE_NONE;
+
+    object->next_unused = unused_objects;
+    unused_objects = index;
   }
 }
 
+static void* get_object(GLuint name, ObjectType type) {
+  assert(name != 0);
+  assert(name <= object_count);
+  Object* object = &objects[name - 1];
+  assert(object->type == type);
+  return object->data;
+}
+
+static Buffer* get_buffer_object(GLuint name) {
+  return get_object(name, OBJECT_TYPE_BUFFER);
+}
+
+static Texture* get_texture_object(GLuint name) {
+  return get_object(name, OBJECT_TYPE_TEXTURE);
+}
+
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
 #define MASK(mask, val) (((val) << (__builtin_ffs(mask)-1)) & (mask))
 
@@ -227,7 +784,8 @@ typedef struct {
     GLenum gl_type;
     unsigned int size;
     size_t stride;
-    const void* data;
+    GLuint buffer;
+    const void* data; // Offset into `buffer` if it is not 0
   } array;
   float value[4];
 } Attrib;
@@ -245,8 +803,18 @@ typedef struct {
   }
 
 static unsigned int active_texture = 0;
+static GLenum texture_downconvert_hint = GL_DONT_CARE; // GL_FASTEST stores RGB8/RGBA8 textures at 16 bits
+static size_t texture_saved_size = 0;
 static unsigned int client_active_texture = 0;
 
+// Forgets the savings of all levels, when level 0 is replaced or the texture deleted
+static void reset_texture_saved_size(Texture* tx) {
+  for(unsigned int i = 0; i < TEXTURE_MAX_LEVELS; i++) {
+    texture_saved_size -= tx->level_saved_size[i];
+    tx->level_saved_size[i] = 0;
+  }
+}
+
 TexEnv texenvs[4] = {
   DEFAULT_TEXENV(),
   DEFAULT_TEXENV(),
@@ -357,6 +925,65 @@ typedef struct {
   float w;
 } ClipPlane;
 static ClipPlane clip_planes[3]; //FIXME: No more needed for neverball
+static bool texture_unit_clip_plane[4] = { false }; // Units whose texcoords carry a clip plane
+
+// Groups of GPU state which `prepare_drawing` derives from the GL state.
+// GL entry points mark the groups they affect, so only those are re-emitted.
+#define DIRTY_ATTRIBS  (1 << 0)
+#define DIRTY_MATRICES (1 << 1)
+#define DIRTY_LIGHTING (1 << 2)
+#define DIRTY_TEXTURES (1 << 3)
+#define DIRTY_TEXENV   (1 << 4)
+#define DIRTY_ALL      (DIRTY_ATTRIBS | DIRTY_MATRICES | DIRTY_LIGHTING | DIRTY_TEXTURES | DIRTY_TEXENV)
+static unsigned int dirty = DIRTY_ALL;
+
+// Shadow copy of the GPU registers which GL entry points set directly.
+// Methods which would write the value a register already has are dropped.
+typedef enum {
+  SHADOW_ALPHA_TEST_ENABLE,
+  SHADOW_NORMALIZATION_ENABLE,
+  SHADOW_CULL_FACE_ENABLE,
+  SHADOW_DEPTH_TEST_ENABLE,
+  SHADOW_STENCIL_TEST_ENABLE,
+  SHADOW_BLEND_ENABLE,
+  SHADOW_LIGHTING_ENABLE,
+  SHADOW_DEPTH_FUNC,
+  SHADOW_DEPTH_MASK,
+  SHADOW_BLEND_FUNC_SFACTOR,
+  SHADOW_BLEND_FUNC_DFACTOR,
+  SHADOW_CULL_FACE,
+  SHADOW_FRONT_FACE,
+  SHADOW_STENCIL_FUNC,
+  SHADOW_STENCIL_FUNC_REF,
+  SHADOW_STENCIL_FUNC_MASK,
+  SHADOW_STENCIL_OP_FAIL,
+  SHADOW_STENCIL_OP_ZFAIL,
+  SHADOW_STENCIL_OP_ZPASS,
+  SHADOW_COLOR_MASK,
+  SHADOW_COUNT
+} ShadowRegister;
+
+static struct {
+  bool valid;
+  uint32_t value;
+} shadow[SHADOW_COUNT];
+static unsigned int filtered_method_count = 0;
+
+// Returns true if the method has to be emitted
+static bool shadow_update(ShadowRegister reg, uint32_t value) {
+  if (shadow[reg].valid && (shadow[reg].value == value)) {
+    filtered_method_count++;
+    return false;
+  }
+  shadow[reg].valid = true;
+  shadow[reg].value = value;
+  return true;
+}
+
+// Must be called when a register was written without `shadow_update`
+static void shadow_invalidate(ShadowRegister reg) {
+  shadow[reg].valid = false;
+}
 
 #include "matrix.h"
 
@@ -365,43 +992,64 @@ static uint32_t* set_enabled(uint32_t* p, GLenum cap, bool enabled) {
   switch(cap) {
   case GL_CLIP_PLANE0 ... GL_CLIP_PLANE0+3-1: //FIXME: Find right GL constant
     clip_planes[cap - GL_CLIP_PLANE0].enabled = enabled;
+    dirty |= DIRTY_TEXTURES;
     break;
   case GL_TEXTURE_GEN_S:
     state.texgen_s_enabled[active_texture] = enabled;
+    dirty |= DIRTY_TEXTURES;
     break;
   case GL_TEXTURE_GEN_T:
     state.texgen_t_enabled[active_texture] = enabled;
+    dirty |= DIRTY_TEXTURES;
     break;
   case GL_ALPHA_TEST:
-    p = xgu_set_alpha_test_enable(p, enabled);
+    if (shadow_update(SHADOW_ALPHA_TEST_ENABLE, enabled)) {
+      p = xgu_set_alpha_test_enable(p, enabled);
+    }
     break;
   case GL_NORMALIZE:
     //FIXME: Needs more changes to matrices?
-    p = xgu_set_normalization_enable(p, enabled);
+    if (shadow_update(SHADOW_NORMALIZATION_ENABLE, enabled)) {
+      p = xgu_set_normalization_enable(p, enabled);
+    }
+    dirty |= DIRTY_MATRICES; // `setup_matrices` currently overrides this
     break;
   case GL_CULL_FACE:
-    p = xgu_set_cull_face_enable(p, enabled);
+    if (shadow_update(SHADOW_CULL_FACE_ENABLE, enabled)) {
+      p = xgu_set_cull_face_enable(p, enabled);
+    }
     break;
   case GL_DEPTH_TEST:
-    p = xgu_set_depth_test_enable(p, enabled);
+    if (shadow_update(SHADOW_DEPTH_TEST_ENABLE, enabled)) {
+      p = xgu_set_depth_test_enable(p, enabled);
+    }
     break;
   case GL_STENCIL_TEST:
-    p = xgu_set_stencil_test_enable(p, enabled);
+    if (shadow_update(SHADOW_STENCIL_TEST_ENABLE, enabled)) {
+      p = xgu_set_stencil_test_enable(p, enabled);
+    }
     break;
   case GL_TEXTURE_2D:
     state.texture_2d[active_texture] = enabled;
+    dirty |= DIRTY_TEXTURES | DIRTY_TEXENV;
     break;
   case GL_BLEND:
-    p = xgu_set_blend_enable(p, enabled);
+    if (shadow_update(SHADOW_BLEND_ENABLE, enabled)) {
+      p = xgu_set_blend_enable(p, enabled);
+    }
     break;
   case GL_LIGHT0 ... GL_LIGHT0+GL_MAX_LIGHTS-1:
     state.lights[cap - GL_LIGHT0].enabled = enabled;
+    dirty |= DIRTY_LIGHTING;
     break;
   case GL_LIGHTING:
-    p = xgu_set_lighting_enable(p, enabled);
+    if (shadow_update(SHADOW_LIGHTING_ENABLE, enabled)) {
+      p = xgu_set_lighting_enable(p, enabled);
+    }
     break;
   case GL_COLOR_MATERIAL:
     state.color_material_enabled = enabled;
+    dirty |= DIRTY_LIGHTING;
     break;
   case GL_POLYGON_OFFSET_FILL:
     unimplemented(); //FIXME: !!!
@@ -436,6 +1084,7 @@ static void set_client_state_enabled(GLenum array, bool enabled) {
     assert(false);
     break;
   }
+  dirty |= DIRTY_ATTRIBS;
 }
 
 static XguPrimitiveType gl_to_xgu_primitive_type(GLenum mode) {
@@ -461,10 +1110,12 @@ typedef unsigned int XguTextureFilter;
 
 static XguTextureFilter gl_to_xgu_texture_filter(GLenum filter) {
   switch(filter) {
-  case GL_NEAREST:               return XGU_TEXTURE_FILTER_NEAREST;
-  case GL_LINEAR:                return XGU_TEXTURE_FILTER_LINEAR;
-  case GL_NEAREST_MIPMAP_LINEAR: return XGU_TEXTURE_FILTER_NEAREST_MIPMAP_LINEAR;
-  case GL_LINEAR_MIPMAP_LINEAR:  return XGU_TEXTURE_FILTER_LINEAR_MIPMAP_LINEAR;
+  case GL_NEAREST:                return XGU_TEXTURE_FILTER_NEAREST;
+  case GL_LINEAR:                 return XGU_TEXTURE_FILTER_LINEAR;
+  case GL_NEAREST_MIPMAP_NEAREST: return XGU_TEXTURE_FILTER_NEAREST_MIPMAP_NEAREST;
+  case GL_LINEAR_MIPMAP_NEAREST:  return XGU_TEXTURE_FILTER_LINEAR_MIPMAP_NEAREST;
+  case GL_NEAREST_MIPMAP_LINEAR:  return XGU_TEXTURE_FILTER_NEAREST_MIPMAP_LINEAR;
+  case GL_LINEAR_MIPMAP_LINEAR:   return XGU_TEXTURE_FILTER_LINEAR_MIPMAP_LINEAR;
   default:
     unimplemented("%d", filter);
     assert(false);
@@ -564,12 +1215,26 @@ static uint8_t f_to_u8(float f) {
     .height = 0, \
     .pitch = 0, \
     .data = NULL, \
+    .data_size = 0, \
     .min_filter = GL_NEAREST_MIPMAP_LINEAR, \
     .mag_filter = GL_LINEAR, \
     .wrap_s = GL_REPEAT, \
     .wrap_t = GL_REPEAT, \
     .internal_base_format = 1, \
-    /* .generate_mipmaps = false */ \
+    .type = GL_UNSIGNED_BYTE, \
+    .format = 0, \
+    .compressed_block_size = 0, \
+    .bytes_per_pixel = 0, \
+    .linear = false, \
+    .palette = NULL, \
+    .downconverted = false, \
+    .dropped_levels = 0, \
+    .level_saved_size = { 0 }, \
+    .generate_mipmap = false, \
+    .explicit_mipmaps = false, \
+    .level_mask = 0, \
+    .sampled = false, \
+    .sample_fence = 0, \
   }
 
 static Texture zero_texture = DEFAULT_TEXTURE();
@@ -581,10 +1246,7 @@ static Texture* get_bound_texture(GLuint stage) {
     return &zero_texture;
   }
 
-  Texture* object = objects[texture - 1].data;
-  assert(object != NULL);
-
-  return object;
+  return get_texture_object(texture);
 }
 
 #define _RC_ZERO 0x0
@@ -884,7 +1546,7 @@ static void setup_texenv() {
       | MASK(NV097_SET_COMBINER_SPECULAR_FOG_CW1_G_SOURCE, _RC_SPARE0) | MASK(NV097_SET_COMBINER_SPECULAR_FOG_CW1_G_ALPHA, 1) | MASK(NV097_SET_COMBINER_SPECULAR_FOG_CW1_G_INVERSE, 0)
       | MASK(NV097_SET_COMBINER_SPECULAR_FOG_CW1_SPECULAR_CLAMP, 0));
 
-  pb_end(p);
+  pb_commit(p);
 }
 
 
@@ -933,6 +1595,16 @@ static GLenum matrix_mode = GL_MODELVIEW;
 
 
 
+// Buffer memory can move, so arrays in buffers are resolved when they are used
+static const void* get_attrib_data(const Attrib* attrib) {
+  if (attrib->array.buffer == 0) {
+    return attrib->array.data;
+  }
+  Buffer* buffer = get_buffer_object(attrib->array.buffer);
+  assert(buffer->data != NULL);
+  return &buffer->data[(uintptr_t)attrib->array.data];
+}
+
 static void print_attrib(XguVertexArray array, Attrib* attrib, unsigned int start, unsigned int count, bool submit) {
   unsigned int end = start + count;
   if (!attrib->array.enabled) {
@@ -940,9 +1612,9 @@ static void print_attrib(XguVertexArray array, Attrib* attrib, unsigned int star
     return;
   }
   if (attrib->array.gl_type == GL_SHORT) {
-    debugPrint("\narray %d as GL_SHORT, stride %d at %p\n", array, attrib->array.stride, attrib->array.data);
+    debugPrint("\narray %d as GL_SHORT, stride %d at %p\n", array, attrib->array.stride, get_attrib_data(attrib));
     for(int i = start; i < end; i++) {
-      int16_t* v = i * attrib->array.stride + (uintptr_t)attrib->array.data;
+      int16_t* v = i * attrib->array.stride + (uintptr_t)get_attrib_data(attrib);
       debugPrint("[%d]:", i);
       for(int j = 0; j < attrib->array.size; j++) {
         debugPrint(" %d", (int)v[j]);
@@ -953,13 +1625,13 @@ static void print_attrib(XguVertexArray array, Attrib* attrib, unsigned int star
         assert(attrib->array.size == 2);
         uint32_t* p = pb_begin();
         p = xgu_vertex4f(p,  v[0], v[1], 0.0f, 1.0f);
-        pb_end(p);
+        pb_commit(p);
       }
     }
   } else if (attrib->array.gl_type == GL_FLOAT) {
-    debugPrint("\narray %d as GL_FLOAT, stride %d at %p\n", array, attrib->array.stride, attrib->array.data);
+    debugPrint("\narray %d as GL_FLOAT, stride %d at %p\n", array, attrib->array.stride, get_attrib_data(attrib));
     for(int i = start; i < end; i++) {
-      float* v = i * attrib->array.stride + (uintptr_t)attrib->array.data;
+      float* v = i * attrib->array.stride + (uintptr_t)get_attrib_data(attrib);
       debugPrint("[%d]:", i);
       for(int j = 0; j < attrib->array.size; j++) {
         debugPrint(" ");
@@ -976,7 +1648,7 @@ static void print_attrib(XguVertexArray array, Attrib* attrib, unsigned int star
         } else {
           assert(false);
         }
-        pb_end(p);
+        pb_commit(p);
       }
     }
   }
@@ -988,17 +1660,49 @@ static void setup_attrib(XguVertexArray array, Attrib* attrib) {
     //FIXME: Somehow XGU should check for XGU_FLOAT if size is 0? type=FLOAT + size=0 means disabled
     p = xgu_set_vertex_data_array_format(p, array, XGU_FLOAT, 0, 0);
     p = xgu_set_vertex_data4f(p, array, attrib->value[0], attrib->value[1], attrib->value[2], attrib->value[3]);
-    pb_end(p);
+    pb_commit(p);
+    return;
+  }
+
+  // Client arrays are copied to stream memory by each draw
+  if (attrib->array.buffer == 0) {
     return;
   }
+
   assert(attrib->array.size > 0);
   assert(attrib->array.stride > 0);
-  xgux_set_attrib_pointer(array, gl_to_xgu_vertex_array_type(attrib->array.gl_type), attrib->array.size, attrib->array.stride, attrib->array.data);
+  xgux_set_attrib_pointer(array, gl_to_xgu_vertex_array_type(attrib->array.gl_type), attrib->array.size, attrib->array.stride, get_attrib_data(attrib));
+}
+
+static bool is_mipmap_filter(GLenum filter) {
+  switch(filter) {
+  case GL_NEAREST_MIPMAP_NEAREST:
+  case GL_LINEAR_MIPMAP_NEAREST:
+  case GL_NEAREST_MIPMAP_LINEAR:
+  case GL_LINEAR_MIPMAP_LINEAR:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static void generate_texture_mipmaps(Texture* tx);
+
+// Number of consecutive levels, starting at level 0, which can be sampled
+static unsigned int get_valid_levels(const Texture* tx) {
+  return __builtin_ctz(~tx->level_mask);
 }
 
 static bool is_texture_complete(Texture* tx) {
   if (tx->width == 0) { return false; }
   if (tx->height == 0) { return false; }
+
+  // Sizes which are not a power of two can't repeat or use mipmaps
+  if (tx->linear) {
+    if ((tx->wrap_s != GL_CLAMP_TO_EDGE) || (tx->wrap_t != GL_CLAMP_TO_EDGE)) { return false; }
+    if (is_mipmap_filter(tx->min_filter)) { return false; }
+  }
+
   unimplemented(); //FIXME: Check mipmaps, filters, ..
   return true;
 }
@@ -1035,6 +1739,10 @@ static unsigned int gl_to_xgu_texture_format(GLenum internalformat) {
   case GL_LUMINANCE_ALPHA: return XGU_TEXTURE_FORMAT_A8Y8_SWIZZLED;
   case GL_RGB:             return XGU_TEXTURE_FORMAT_X8R8G8B8_SWIZZLED;
   case GL_RGBA:            return XGU_TEXTURE_FORMAT_A8B8G8R8_SWIZZLED;
+  case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:  return XGU_TEXTURE_FORMAT_DXT1_A1R5G5B5;
+  case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT: return XGU_TEXTURE_FORMAT_DXT1_A1R5G5B5;
+  case GL_COMPRESSED_RGBA_S3TC_DXT3_EXT: return XGU_TEXTURE_FORMAT_DXT3_A8R8G8B8;
+  case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT: return XGU_TEXTURE_FORMAT_DXT5_A8R8G8B8;
   default:
     unimplemented("%d", internalformat);
     assert(false);
@@ -1043,6 +1751,44 @@ static unsigned int gl_to_xgu_texture_format(GLenum internalformat) {
   return -1;
 }
 
+static unsigned int gl_to_xgu_packed_texture_format(GLenum type) {
+  switch(type) {
+  case GL_UNSIGNED_SHORT_5_6_5:   return XGU_TEXTURE_FORMAT_R5G6B5_SWIZZLED;
+  case GL_UNSIGNED_SHORT_4_4_4_4: return XGU_TEXTURE_FORMAT_A4R4G4B4_SWIZZLED;
+  case GL_UNSIGNED_SHORT_5_5_5_1: return XGU_TEXTURE_FORMAT_A1R5G5B5_SWIZZLED;
+  default:
+    unimplemented("%d", type);
+    assert(false);
+    break;
+  }
+  return -1;
+}
+
+static unsigned int get_linear_texture_format(unsigned int format) {
+  switch(format) {
+  case XGU_TEXTURE_FORMAT_Y8_SWIZZLED:       return XGU_TEXTURE_FORMAT_Y8;
+  case XGU_TEXTURE_FORMAT_A8Y8_SWIZZLED:     return XGU_TEXTURE_FORMAT_A8Y8;
+  case XGU_TEXTURE_FORMAT_X8R8G8B8_SWIZZLED: return XGU_TEXTURE_FORMAT_X8R8G8B8;
+  case XGU_TEXTURE_FORMAT_A8B8G8R8_SWIZZLED: return XGU_TEXTURE_FORMAT_A8B8G8R8;
+  case XGU_TEXTURE_FORMAT_R5G6B5_SWIZZLED:   return XGU_TEXTURE_FORMAT_R5G6B5;
+  case XGU_TEXTURE_FORMAT_A4R4G4B4_SWIZZLED: return XGU_TEXTURE_FORMAT_A4R4G4B4;
+  case XGU_TEXTURE_FORMAT_A1R5G5B5_SWIZZLED: return XGU_TEXTURE_FORMAT_A1R5G5B5;
+  default:
+    unimplemented("%d", format);
+    assert(false);
+    break;
+  }
+  return -1;
+}
+
+// Units which no longer carry a clip plane read their texcoords again
+static void restore_texture_coord_attrib(unsigned int unit) {
+  if (texture_unit_clip_plane[unit]) {
+    setup_attrib(XGU_TEXCOORD0_ARRAY+unit, &state.texture_coord_array[unit]);
+    texture_unit_clip_plane[unit] = false;
+  }
+}
+
 static void setup_textures() {
 
   uint32_t* p;
@@ -1054,7 +1800,7 @@ static void setup_textures() {
         MASK(NV097_SET_SHADER_OTHER_STAGE_INPUT_STAGE1, 0)
       | MASK(NV097_SET_SHADER_OTHER_STAGE_INPUT_STAGE2, 0)
       | MASK(NV097_SET_SHADER_OTHER_STAGE_INPUT_STAGE3, 0));
-  pb_end(p);
+  pb_commit(p);
 
   unsigned int clip_plane_index = 0;
   unsigned int shaders[4];
@@ -1071,7 +1817,7 @@ static void setup_textures() {
       p = pb_begin();
       p = xgu_set_texture_control0(p, i, false, 0, 0);
       //FIXME: pbkit also sets wrap/addressing and filter stuff for disabled textures?!
-      pb_end(p);
+      pb_commit(p);
 
       // Find the next used clip plane
       while(clip_plane_index < ARRAY_SIZE(clip_planes)) {
@@ -1093,6 +1839,7 @@ static void setup_textures() {
           .value = { clip_plane->x, clip_plane->y, clip_plane->z, clip_plane->w }
         };
         setup_attrib(XGU_TEXCOORD0_ARRAY+i, &attrib);
+        texture_unit_clip_plane[i] = true;
 
         // Setup shader
         //FIXME: Can use 4 clip planes per texture unit by using texture-matrix?
@@ -1105,11 +1852,19 @@ static void setup_textures() {
       }
 
       // Disable texture shader if nothing depends on it
+      restore_texture_coord_attrib(i);
       shaders[i] = NV097_SET_SHADER_STAGE_PROGRAM_STAGE0_PROGRAM_NONE;
 
       continue;
     }
 
+    restore_texture_coord_attrib(i);
+
+    // Mipmaps are only built once they are sampled
+    if (tx->generate_mipmap && is_mipmap_filter(tx->min_filter)) {
+      generate_texture_mipmaps(tx);
+    }
+
     // Sanity check texture
     assert(tx->width != 0);
     assert(tx->height != 0);
@@ -1128,26 +1883,38 @@ static void setup_textures() {
     unsigned int context_dma = 2; //FIXME: Which one did pbkit use?
     XguBorderSrc border = XGU_SOURCE_COLOR;
 
-    unsigned int mipmap_levels = MAX(tx->width_shift, tx->height_shift) + 1;
+    //FIXME: Texture is incomplete in GL if it uses a mipmap filter without mipmaps
+    unsigned int mipmap_levels = get_valid_levels(tx);
     unsigned int min_lod = 0;
     unsigned int max_lod = mipmap_levels - 1;
     unsigned int lod_bias = 0;
 
     p = xgu_set_texture_offset(p, i, (uintptr_t)tx->data & 0x03ffffff);
+    if (tx->format == XGU_TEXTURE_FORMAT_I8_A8R8G8B8_SWIZZLED) {
+      assert(tx->palette != NULL);
+      p = pb_push1(p, NV097_SET_TEXTURE_PALETTE + i * 64,
+            MASK(NV097_SET_TEXTURE_PALETTE_CONTEXT_DMA, 1) //FIXME: Should match context_dma
+          | MASK(NV097_SET_TEXTURE_PALETTE_LENGTH, 0) // 256 entries
+          | ((uintptr_t)tx->palette & 0x03ffffc0));
+    }
     p = xgu_set_texture_format(p, i, context_dma, cubemap_enable, border, dimensionality,
-                                     gl_to_xgu_texture_format(tx->internal_base_format), mipmap_levels,
+                                     tx->format, mipmap_levels,
                                      tx->width_shift,tx->height_shift,0);
     p = xgu_set_texture_address(p, i, gl_to_xgu_texture_address(tx->wrap_s), false,
                                       gl_to_xgu_texture_address(tx->wrap_t), false,
                                       XGU_CLAMP_TO_EDGE, false,
                                       false);
     p = xgu_set_texture_control0(p, i, true, min_lod, max_lod);
-//    p = xgu_set_texture_control1(p, i, 0x800000 /*tx->pitch*/);
+    if (tx->linear) {
+      p = xgu_set_texture_control1(p, i, tx->pitch);
+    }
     p = xgu_set_texture_filter(p, i, lod_bias, XGU_TEXTURE_CONVOLUTION_QUINCUNX,
                                         gl_to_xgu_texture_filter(tx->min_filter),
                                         gl_to_xgu_texture_filter(tx->mag_filter),
                                         false, false, false, false);
-//    p = xgu_set_texture_image_rect(p, i, 0 /*tx->width*/, 0 /*tx->height*/);
+    if (tx->linear) {
+      p = xgu_set_texture_image_rect(p, i, tx->width, tx->height);
+    }
 
 #if 0
     //FIXME: Use NV097_SET_TEXTURE_FORMAT and friends
@@ -1169,9 +1936,21 @@ static void setup_textures() {
     p = xgu_set_texgen_q(p, i, XGU_TEXGEN_DISABLE);
     p = xgu_set_texture_matrix_enable(p, i, true); //FIXME: See if this makes a perf difference and only enable if not identity?
     unimplemented(); //FIXME: Not hitting pixel centers yet?!
-    p = xgu_set_texture_matrix(p, i, &matrix_t[i][0]);
 
-    pb_end(p);
+    // Linear textures are addressed in texels
+    const float* texture_matrix = &matrix_t[i][0];
+    float scaled_texture_matrix[4*4];
+    if (tx->linear) {
+      memcpy(scaled_texture_matrix, texture_matrix, sizeof(scaled_texture_matrix));
+      for(int j = 0; j < 4; j++) {
+        scaled_texture_matrix[j*4+0] *= tx->width;
+        scaled_texture_matrix[j*4+1] *= tx->height;
+      }
+      texture_matrix = scaled_texture_matrix;
+    }
+    p = xgu_set_texture_matrix(p, i, texture_matrix);
+
+    pb_commit(p);
   }
 
   // Setup texture shader
@@ -1181,7 +1960,7 @@ static void setup_textures() {
       | MASK(NV097_SET_SHADER_STAGE_PROGRAM_STAGE1, shaders[1])
       | MASK(NV097_SET_SHADER_STAGE_PROGRAM_STAGE2, shaders[2])
       | MASK(NV097_SET_SHADER_STAGE_PROGRAM_STAGE3, shaders[3]));
-  pb_end(p);
+  pb_commit(p);
 
 
   // Assert that we handled all clip planes
@@ -1201,11 +1980,13 @@ static void setup_matrices() {
     const float m_identity[4*4] = DEFAULT_MATRIX();
 
     p = xgu_set_skin_mode(p, XGU_SKIN_MODE_OFF);
-    p = xgu_set_normalization_enable(p, false);
+    if (shadow_update(SHADOW_NORMALIZATION_ENABLE, false)) {
+      p = xgu_set_normalization_enable(p, false);
+    }
 
 
 
-    pb_end(p);
+    pb_commit(p);
 
     int width = pb_back_buffer_width();
     int height = pb_back_buffer_height();
@@ -1319,7 +2100,7 @@ TRANSPOSE(matrix_mv_now)
 
   p = xgu_set_viewport_offset(p, 0.0f, 0.0f, 0.0f, 0.0f);
   p = xgu_set_viewport_scale(p, 1.0f, 1.0f, 1.0f, 1.0f); //FIXME: Ignored?!
-  pb_end(p);
+  pb_commit(p);
 
 }
 
@@ -1521,7 +2302,7 @@ static void setup_lighting() {
 
       p = xgu_set_light_local_attenuation(p, i, l->constant_attenuation, l->linear_attenuation, l->quadratic_attenuation);
 
-      pb_end(p);
+      pb_commit(p);
 
       XguVec3 direction = {
         l->spot_direction.x,
@@ -1609,98 +2390,572 @@ static void setup_lighting() {
                                    mask[6],
                                    mask[7]);
 
-  pb_end(p);
+  pb_commit(p);
 
   // Set material
   xgux_set_specular_gl(state.material[0].shininess);
   xgux_set_back_specular_gl(state.material[1].shininess);
 }
 
+// Pushbuffer ring
+//
+// The pushbuffer is used as a ring which the GPU consumes while we keep
+// recording. When the space before its end runs low, a jump back to the head
+// is written. Positions are counted in words since startup so they only grow;
+// a fence is such a position and is consumed once the GPU has fetched it.
+// We only wait when we are about to overwrite words the GPU has yet to fetch.
+
+// pbkit's default, which apps can change with pb_size() before pb_init()
+#ifndef PB_SIZE
+#define PB_SIZE (512 * 1024)
+#endif
+#define PB_SLACK (4 * 1024) // Words which may be written outside of `pb_reserve`
+#define PB_JUMP(offset) (0x20000000 | (offset))
+
+#ifndef NV_USER_DMA_GET
+#define NV_USER_DMA_GET 0x00800044
+#endif
+
+
+static uint32_t* pb_head = NULL;
+static Fence pb_lap_start = 0;      // Position of `pb_head` in the current lap
+static Fence pb_prev_lap_start = 0; // Position of `pb_head` in the previous lap
+static Fence pb_prev_lap_end = 0;   // Position after the jump which ended the previous lap
+static Fence pb_completed = 0;      // Position up to which the GPU was last seen idle
+static const uint32_t* pb_limit = NULL; // End of the space ensured by `pb_reserve`
+
 static size_t p_size = 0;
-static ULONGLONG gpu_duration = 0;
+static ULONGLONG stall_duration = 0;
 static ULONGLONG cpu_duration = 0;
-static void reset_pb() {
+static Fence frame_start = 0;
+static ULONGLONG frame_start_time = 0;
+
+static uint32_t* pb_tell() {
+  uint32_t* p = pb_begin();
+  pb_end(p);
+  return p;
+}
 
-  // Measure time since last call to this function
-  static ULONGLONG cpu_last = 0;
-  ULONGLONG cpu_now = KeQueryPerformanceCounter();
-  ULONGLONG cpu_duration_batch = cpu_now - cpu_last;
+static Fence pb_position(const uint32_t* p) {
+  return pb_lap_start + (p - pb_head);
+}
 
-  // Get pb pointer at end
-  uint32_t* p_tail = pb_begin(); pb_end(p_tail);
+static Fence pb_fence() {
+  return pb_position(pb_tell());
+}
 
-  // Finish pb
-  while(pb_busy());
+// Position up to which the GPU has fetched the pushbuffer
+static Fence pb_consumed() {
+  uint32_t* p = pb_tell();
+  if (!pb_busy()) {
+    pb_completed = pb_position(p);
+    return pb_completed;
+  }
 
-  // Go to head of pb and get pointer
-  pb_reset();
-  uint32_t* p_head = pb_begin(); pb_end(p_head);
-  size_t p_size_batch = (p_tail - p_head) * 4;
+  size_t write_offset = p - pb_head;
+  size_t read_offset = ((VIDEOREG(NV_USER_DMA_GET) & 0x03ffffff) - ((uintptr_t)pb_head & 0x03ffffff)) / 4;
+  assert(read_offset < PB_SIZE / 4);
 
-  // Measure time that we required for GPU synchronization
-  cpu_last = KeQueryPerformanceCounter();
-  ULONGLONG gpu_duration_batch = cpu_last - cpu_now;
+  // We never overtake the GPU, so if it is ahead of us it must still be in the previous lap
+  if (read_offset <= write_offset) {
+    return pb_lap_start + read_offset;
+  }
+  return pb_prev_lap_start + read_offset;
+}
 
-  // Accumulate statistics
-  p_size += p_size_batch;
-  cpu_duration += cpu_duration_batch;
-  gpu_duration += gpu_duration_batch;
+static bool fence_consumed(Fence fence) {
+  return pb_consumed() >= fence;
 }
 
-static unsigned int drawcall_count = 0;
-static void prepare_drawing() {
-  drawcall_count += 1;
+// Whether the GPU finished the commands which follow `fence`; this is only
+// known once it was seen idle after them
+static bool fence_passed(Fence fence) {
+  pb_consumed();
+  return pb_completed > fence;
+}
+
+static void fence_wait(Fence fence) {
+  if (fence_consumed(fence)) {
+    return;
+  }
 
-  unimplemented(); //FIXME: Measure length of buffer and resize so we can handle large levels
-                   //       `reset_pb` is too expensive.
-  reset_pb();
+  ULONGLONG stall_start = KeQueryPerformanceCounter();
+  while(!fence_consumed(fence));
+  stall_duration += KeQueryPerformanceCounter() - stall_start;
+}
 
-  debugPrint("Preparing to draw\n");
+// Wait for the GPU to finish all work
+static void pb_sync() {
+  ULONGLONG stall_start = KeQueryPerformanceCounter();
+  while(pb_busy());
+  stall_duration += KeQueryPerformanceCounter() - stall_start;
+  pb_completed = pb_fence();
+}
 
-  //FIXME: Track dirty bits
+// Memory which the GPU might still read is only freed once it has finished
+// all commands which were submitted before the memory was retired.
+// Fetching the commands is not enough, as draws might still be in flight.
+typedef struct {
+  void* ptr;
+  Fence fence;
+} RetiredResource;
 
-  // Setup lights from state.light[].enabled
-  //FIXME: This uses a mask: p = xgu_set_light_enable(p, );
+static RetiredResource* retired_resources = NULL;
+static unsigned int retired_resource_count = 0;
+static unsigned int retired_resource_capacity = 0;
 
-  // Setup attributes
-#if 1
-  uint32_t* p = pb_begin();
-  for(int i = 0; i < 16; i++) {
-    p = xgu_set_vertex_data_array_format(p, i, XGU_FLOAT, 0, 0);
+// Frees the retired memory which the GPU is done with
+static void collect_retired_resources() {
+  if (retired_resource_count == 0) {
+    return;
   }
-  pb_end(p);
-#endif
-  setup_attrib(XGU_VERTEX_ARRAY, &state.vertex_array);
-  setup_attrib(XGU_COLOR_ARRAY, &state.color_array);
-  setup_attrib(XGU_NORMAL_ARRAY, &state.normal_array);
-  setup_attrib(XGU_TEXCOORD0_ARRAY, &state.texture_coord_array[0]);
-  setup_attrib(XGU_TEXCOORD1_ARRAY, &state.texture_coord_array[1]);
-  setup_attrib(XGU_TEXCOORD2_ARRAY, &state.texture_coord_array[2]);
-  setup_attrib(XGU_TEXCOORD3_ARRAY, &state.texture_coord_array[3]);
+  pb_consumed(); // Notices if the GPU became idle
 
-  // Set up all matrices etc.
-  setup_matrices();
+  // Fences are in submission order
+  unsigned int count = 0;
+  while((count < retired_resource_count) && (retired_resources[count].fence <= pb_completed)) {
+    FreeResourceMemory(retired_resources[count].ptr);
+    count++;
+  }
+  retired_resource_count -= count;
+  memmove(&retired_resources[0], &retired_resources[count], retired_resource_count * sizeof(RetiredResource));
+}
 
-  // Setup lighting
-  setup_lighting();
+// Replaces FreeResourceMemory for memory which might have been used in commands
+static void RetireResourceMemory(void* ptr) {
+  disown_resource_memory(ptr);
+  if (retired_resource_count == retired_resource_capacity) {
+    retired_resource_capacity = MAX(retired_resource_capacity * 2, 64);
+    retired_resources = realloc(retired_resources, retired_resource_capacity * sizeof(RetiredResource));
+    assert(retired_resources != NULL);
+  }
+  RetiredResource* retired = &retired_resources[retired_resource_count++];
+  retired->ptr = ptr;
+  retired->fence = pb_fence();
+  collect_retired_resources();
+}
+
+// Waits for the GPU to free all retired memory; returns false if there was none
+static bool reclaim_retired_resources() {
+  if (retired_resource_count == 0) {
+    return false;
+  }
+  pb_sync();
+  collect_retired_resources();
+  return true;
+}
+
+static void pb_reserve(size_t words);
+
+static void pb_ring_init() {
+  pb_sync();
+  pb_reset();
+  pb_head = pb_tell();
+
+  // pbkit allocates the pushbuffer at its head, the ring must fit into it
+  assert(MmQueryAllocationSize(pb_head) >= PB_SIZE);
+
+  pb_reserve(0);
+  frame_start_time = KeQueryPerformanceCounter();
+}
+
+// Ensures that `words` can be written without overwriting unconsumed commands
+static void pb_reserve(size_t words) {
+  words += PB_SLACK;
+  assert(words + 1 <= PB_SIZE / 4);
+
+  uint32_t* p = pb_tell();
+  size_t write_offset = p - pb_head;
+
+  // Continue at the head if this wouldn't fit before the end (leaving room for the jump)
+  if (write_offset + words + 1 > PB_SIZE / 4) {
+    uint32_t* jump = pb_begin();
+    p = jump;
+    *p++ = PB_JUMP((uintptr_t)pb_head & 0x03ffffff);
+    pb_end(p);
+
+    pb_prev_lap_start = pb_lap_start;
+    pb_prev_lap_end = pb_position(p);
+    pb_lap_start = pb_prev_lap_end;
+
+    // pbkit's pb_reset() only rewinds its write pointer; any time it spends
+    // waiting would show up as a stall, and it must not touch our jump
+    ULONGLONG reset_start = KeQueryPerformanceCounter();
+    pb_reset();
+    stall_duration += KeQueryPerformanceCounter() - reset_start;
+    assert(pb_tell() == pb_head);
+    assert(*(volatile uint32_t*)jump == PB_JUMP((uintptr_t)pb_head & 0x03ffffff));
+    write_offset = 0;
+  }
+
+  // The region still holds the previous lap, which has to be fetched before we overwrite it
+  Fence fence = pb_prev_lap_start + write_offset + words + 1;
+  if (fence > pb_prev_lap_end) {
+    fence = pb_prev_lap_end;
+  }
+  fence_wait(fence);
+
+  pb_limit = &pb_head[write_offset + words];
+}
+
+static void pb_commit(uint32_t* p) {
+
+  // Everything outside of draws has to fit into the slack of the last reservation
+  assert(p <= pb_limit);
+  pb_end(p);
+
+  // Keep enough slack for the next commands
+  if (pb_limit - p < PB_SLACK / 2) {
+    pb_reserve(0);
+  }
+}
+
+// The GPU can't read client arrays, so the vertices which a draw uses are
+// copied into a ring of contiguous memory. A segment of the ring is only
+// written again after the GPU finished all draws which used it.
+#define STREAM_RING_SEGMENT_SIZE (1024 * 1024)
+#define STREAM_RING_SEGMENTS 4
+#define STREAM_ALIGNMENT 16
+
+// Upper bound for the words emitted by `stream_client_arrays`
+#define PB_STREAM_WORDS (8 * 4)
+
+static uint8_t* stream_ring = NULL;
+static unsigned int stream_ring_segment = 0;
+static size_t stream_ring_offset = 0; // Offset into the current segment
+static Fence stream_ring_fences[STREAM_RING_SEGMENTS]; // Position after the draws which used each segment
+static size_t stream_size = 0; // Bytes streamed in this frame
+
+// Draws which don't fit into a segment get their own memory, which is retired
+// once the draw has been recorded
+static void* stream_dedicated = NULL;
+
+static void retire_stream_memory() {
+  if (stream_dedicated != NULL) {
+    RetireResourceMemory(stream_dedicated);
+    stream_dedicated = NULL;
+  }
+}
+
+static void* allocate_stream_memory(size_t size) {
+  retire_stream_memory();
+  stream_size += size;
+  if (size > STREAM_RING_SEGMENT_SIZE) {
+    stream_dedicated = AllocateResourceMemory(size, STREAM_ALIGNMENT, NULL);
+    return stream_dedicated;
+  }
+
+  if (stream_ring == NULL) {
+    stream_ring = AllocateContiguousMemory(STREAM_RING_SEGMENT_SIZE * STREAM_RING_SEGMENTS, 0);
+    assert(stream_ring != NULL);
+  }
+
+  // Move on to the next segment, once the GPU is done with it
+  if (stream_ring_offset + size > STREAM_RING_SEGMENT_SIZE) {
+    stream_ring_fences[stream_ring_segment] = pb_fence();
+    stream_ring_segment = (stream_ring_segment + 1) % STREAM_RING_SEGMENTS;
+    stream_ring_offset = 0;
+    pb_consumed();
+    if (pb_completed < stream_ring_fences[stream_ring_segment]) {
+      pb_sync();
+    }
+  }
+
+  uint8_t* ptr = &stream_ring[stream_ring_segment * STREAM_RING_SEGMENT_SIZE + stream_ring_offset];
+  stream_ring_offset += (size + STREAM_ALIGNMENT - 1) & ~(size_t)(STREAM_ALIGNMENT - 1);
+  return ptr;
+}
+
+static unsigned int get_vertex_type_size(GLenum gl_type) {
+  switch(gl_type) {
+  case GL_FLOAT:         return 4;
+  case GL_SHORT:         return 2;
+  case GL_UNSIGNED_BYTE: return 1;
+  default:
+    unimplemented("%d", gl_type);
+    assert(false);
+    return 0;
+  }
+}
+
+// Finds the smallest and largest of `count` 16-bit indices
+static void get_index_range16(const uint16_t* indices, GLsizei count, uint16_t* min_index, uint16_t* max_index) {
+  assert(count > 0);
+  uint16_t min_value = 0xFFFF;
+  uint16_t max_value = 0x0000;
+  GLsizei i = 0;
+
+#ifdef __SSE__
+  // SSE only compares signed 16-bit values, so the indices are biased
+  if (count >= 8) {
+    const __m64 bias = _mm_set1_pi16((short)0x8000);
+    __m64 min_a = _mm_set1_pi16(0x7FFF);
+    __m64 max_a = _mm_set1_pi16((short)0x8000);
+    __m64 min_b = min_a;
+    __m64 max_b = max_a;
+    for(; i + 8 <= count; i += 8) {
+      __m64 a;
+      __m64 b;
+      memcpy(&a, &indices[i + 0], sizeof(a));
+      memcpy(&b, &indices[i + 4], sizeof(b));
+      a = _mm_xor_si64(a, bias);
+      b = _mm_xor_si64(b, bias);
+      min_a = _mm_min_pi16(min_a, a);
+      max_a = _mm_max_pi16(max_a, a);
+      min_b = _mm_min_pi16(min_b, b);
+      max_b = _mm_max_pi16(max_b, b);
+    }
+    __m64 mins = _mm_xor_si64(_mm_min_pi16(min_a, min_b), bias);
+    __m64 maxs = _mm_xor_si64(_mm_max_pi16(max_a, max_b), bias);
+    uint16_t lanes_min[4];
+    uint16_t lanes_max[4];
+    memcpy(lanes_min, &mins, sizeof(lanes_min));
+    memcpy(lanes_max, &maxs, sizeof(lanes_max));
+    _mm_empty();
+    for(int lane = 0; lane < 4; lane++) {
+      min_value = MIN(min_value, lanes_min[lane]);
+      max_value = MAX(max_value, lanes_max[lane]);
+    }
+  }
+#endif
+
+  for(; i < count; i++) {
+    min_value = MIN(min_value, indices[i]);
+    max_value = MAX(max_value, indices[i]);
+  }
+  *min_index = min_value;
+  *max_index = max_value;
+}
+
+// Index ranges of draws from buffers are cached, so static meshes are only
+// scanned once
+static void get_buffer_index_range16(Buffer* buffer, size_t offset, GLsizei count, uint16_t* min_index, uint16_t* max_index) {
+  for(int i = 0; i < BUFFER_INDEX_RANGES; i++) {
+    const IndexRange* range = &buffer->index_ranges[i];
+    if ((range->count == count) && (range->offset == offset)) {
+      *min_index = range->min_index;
+      *max_index = range->max_index;
+      return;
+    }
+  }
+
+  assert(offset + count * sizeof(uint16_t) <= buffer->size);
+  //FIXME: Reads back from write-combined memory
+  get_index_range16((const uint16_t*)&buffer->data[offset], count, min_index, max_index);
+
+  IndexRange* range = &buffer->index_ranges[buffer->next_index_range];
+  range->offset = offset;
+  range->count = count;
+  range->min_index = *min_index;
+  range->max_index = *max_index;
+  buffer->next_index_range = (buffer->next_index_range + 1) % BUFFER_INDEX_RANGES;
+}
+
+static void invalidate_buffer_index_ranges(Buffer* buffer) {
+  for(int i = 0; i < BUFFER_INDEX_RANGES; i++) {
+    buffer->index_ranges[i].count = 0;
+  }
+}
+
+typedef struct {
+  XguVertexArray array;
+  Attrib* attrib;
+} VertexArray;
+
+static bool has_client_arrays() {
+  Attrib* attribs[] = {
+    &state.vertex_array, &state.color_array, &state.normal_array,
+    &state.texture_coord_array[0], &state.texture_coord_array[1],
+    &state.texture_coord_array[2], &state.texture_coord_array[3]
+  };
+  for(int i = 0; i < ARRAY_SIZE(attribs); i++) {
+    if (attribs[i]->array.enabled && (attribs[i]->array.buffer == 0)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Texcoords of units which carry a clip plane are not read from their array
+static bool is_vertex_array_used(const VertexArray* array) {
+  if ((array->array >= XGU_TEXCOORD0_ARRAY) && (array->array <= XGU_TEXCOORD3_ARRAY) &&
+      texture_unit_clip_plane[array->array - XGU_TEXCOORD0_ARRAY]) {
+    return false;
+  }
+  return array->attrib->array.enabled;
+}
+
+// Copies vertices [start, end) of the enabled client arrays into stream
+// memory and points the GPU at them. Returns the vertex which ended up at
+// index 0; it has to be subtracted from the indices of the draw.
+static GLint stream_client_arrays(GLint start, GLint end) {
+  VertexArray arrays[] = {
+    { XGU_VERTEX_ARRAY, &state.vertex_array },
+    { XGU_COLOR_ARRAY, &state.color_array },
+    { XGU_NORMAL_ARRAY, &state.normal_array },
+    { XGU_TEXCOORD0_ARRAY, &state.texture_coord_array[0] },
+    { XGU_TEXCOORD1_ARRAY, &state.texture_coord_array[1] },
+    { XGU_TEXCOORD2_ARRAY, &state.texture_coord_array[2] },
+    { XGU_TEXCOORD3_ARRAY, &state.texture_coord_array[3] }
+  };
+  if (start >= end) {
+    return 0;
+  }
+
+  // Vertices can only be moved to index 0 if no array is in a buffer
+  GLint base = start;
+  for(int i = 0; i < ARRAY_SIZE(arrays); i++) {
+    const Attrib* attrib = arrays[i].attrib;
+    if (is_vertex_array_used(&arrays[i]) && (attrib->array.buffer != 0)) {
+      base = 0;
+    }
+  }
+
+  // All arrays of a draw share one allocation, so they are in one segment
+  size_t sizes[ARRAY_SIZE(arrays)];
+  size_t strides[ARRAY_SIZE(arrays)];
+  size_t total_size = 0;
+  for(int i = 0; i < ARRAY_SIZE(arrays); i++) {
+    const Attrib* attrib = arrays[i].attrib;
+    if (!is_vertex_array_used(&arrays[i]) || (attrib->array.buffer != 0)) {
+      sizes[i] = 0;
+      continue;
+    }
+    size_t element_size = attrib->array.size * get_vertex_type_size(attrib->array.gl_type);
+    strides[i] = (attrib->array.stride != 0) ? attrib->array.stride : element_size;
+    sizes[i] = (end - base - 1) * strides[i] + element_size;
+    total_size += (sizes[i] + STREAM_ALIGNMENT - 1) & ~(size_t)(STREAM_ALIGNMENT - 1);
+  }
+  if (total_size == 0) {
+    return 0;
+  }
+
+  uint8_t* dst = allocate_stream_memory(total_size);
+  for(int i = 0; i < ARRAY_SIZE(arrays); i++) {
+    const Attrib* attrib = arrays[i].attrib;
+    if (sizes[i] == 0) {
+      continue;
+    }
+    assert(attrib->array.data != NULL);
+    memcpy(dst, (const uint8_t*)attrib->array.data + base * strides[i], sizes[i]);
+    xgux_set_attrib_pointer(arrays[i].array, gl_to_xgu_vertex_array_type(attrib->array.gl_type), attrib->array.size, strides[i], dst);
+    dst += (sizes[i] + STREAM_ALIGNMENT - 1) & ~(size_t)(STREAM_ALIGNMENT - 1);
+  }
+  return base;
+}
+
+// Upper bound for the words emitted by `prepare_drawing` if everything is dirty
+#define PB_DRAW_STATE_WORDS (4 * 1024)
+
+static unsigned int drawcall_count = 0;
+static void prepare_drawing(size_t draw_words) {
+  drawcall_count += 1;
+
+  pb_reserve(PB_DRAW_STATE_WORDS + draw_words);
+
+  debugPrint("Preparing to draw\n");
+
+  // The debug controls below bypass the dirty tracking, so everything is
+  // emitted while they are held and once more after they have been released
+  static bool debug_controls = false;
+  bool debug_controls_now = SDL_GameControllerGetButton(g, SDL_CONTROLLER_BUTTON_RIGHTSHOULDER) ||
+                            SDL_GameControllerGetButton(g, SDL_CONTROLLER_BUTTON_DPAD_LEFT) ||
+                            SDL_GameControllerGetButton(g, SDL_CONTROLLER_BUTTON_DPAD_RIGHT) ||
+                            SDL_GameControllerGetButton(g, SDL_CONTROLLER_BUTTON_DPAD_UP) ||
+                            SDL_GameControllerGetButton(g, SDL_CONTROLLER_BUTTON_DPAD_DOWN);
+  if (debug_controls || debug_controls_now) {
+    dirty = DIRTY_ALL;
+  }
+  debug_controls = debug_controls_now;
+
+  // Clip planes are passed through the texcoord attributes
+  if (dirty & DIRTY_ATTRIBS) {
+    for(int i = 0; i < ARRAY_SIZE(clip_planes); i++) {
+      if (clip_planes[i].enabled) {
+        dirty |= DIRTY_TEXTURES;
+      }
+    }
+  }
+
+  // Setup lights from state.light[].enabled
+  //FIXME: This uses a mask: p = xgu_set_light_enable(p, );
+
+  // Setup attributes
+  if (dirty & DIRTY_ATTRIBS) {
+#if 1
+    uint32_t* p = pb_begin();
+    for(int i = 0; i < 16; i++) {
+      p = xgu_set_vertex_data_array_format(p, i, XGU_FLOAT, 0, 0);
+    }
+    pb_commit(p);
+#endif
+    setup_attrib(XGU_VERTEX_ARRAY, &state.vertex_array);
+    setup_attrib(XGU_COLOR_ARRAY, &state.color_array);
+    setup_attrib(XGU_NORMAL_ARRAY, &state.normal_array);
+    setup_attrib(XGU_TEXCOORD0_ARRAY, &state.texture_coord_array[0]);
+    setup_attrib(XGU_TEXCOORD1_ARRAY, &state.texture_coord_array[1]);
+    setup_attrib(XGU_TEXCOORD2_ARRAY, &state.texture_coord_array[2]);
+    setup_attrib(XGU_TEXCOORD3_ARRAY, &state.texture_coord_array[3]);
+  }
+
+  // Set up all matrices etc.
+  if (dirty & DIRTY_MATRICES) {
+    setup_matrices();
+  }
+
+  // Setup lighting
+  if (dirty & DIRTY_LIGHTING) {
+    setup_lighting();
+  }
 
 #if 1
   if (SDL_GameControllerGetButton(g, SDL_CONTROLLER_BUTTON_RIGHTSHOULDER)) {
     pb_print("Lighting disabled\n");
     uint32_t* p = pb_begin();
     p = xgu_set_lighting_enable(p, false);
-    pb_end(p);
+    pb_commit(p);
+    shadow_invalidate(SHADOW_LIGHTING_ENABLE);
   }
 #endif
 
   // Setup textures
-  setup_textures();
+  if (dirty & DIRTY_TEXTURES) {
+    setup_textures();
+  }
+
+  // Texture memory must not be overwritten until the GPU finished this draw
+  Fence draw_fence = pb_fence();
+  for(int i = 0; i < 4; i++) {
+    if (state.texture_2d[i]) {
+      Texture* tx = get_bound_texture(i);
+      tx->sampled = true;
+      tx->sample_fence = draw_fence;
+    }
+  }
+
+  // The same goes for the buffers which the vertex arrays point into
+  Attrib* attribs[] = {
+    &state.vertex_array, &state.color_array, &state.normal_array,
+    &state.texture_coord_array[0], &state.texture_coord_array[1],
+    &state.texture_coord_array[2], &state.texture_coord_array[3]
+  };
+  for(int i = 0; i < ARRAY_SIZE(attribs); i++) {
+    if (attribs[i]->array.enabled && (attribs[i]->array.buffer != 0)) {
+      Buffer* buffer = get_buffer_object(attribs[i]->array.buffer);
+      buffer->used = true;
+      buffer->use_fence = draw_fence;
+    }
+  }
 
 debugPrint("texenv setup");
   // Set the register combiner
-  setup_texenv();
+  if (dirty & DIRTY_TEXENV) {
+    setup_texenv();
+  }
 debugPrint("debug stuff");
 
+  dirty = 0;
+
 #if 0
   {
     // Set some safe state
@@ -1740,12 +2995,16 @@ debugPrint("debug stuff");
     p = xgu_set_blend_func_dfactor(p, XGU_FACTOR_ONE_MINUS_SRC_ALPHA);
     p = xgu_set_alpha_test_enable(p, false);
     p = xgu_set_blend_enable(p, true);
+    shadow_invalidate(SHADOW_BLEND_FUNC_SFACTOR);
+    shadow_invalidate(SHADOW_BLEND_FUNC_DFACTOR);
+    shadow_invalidate(SHADOW_ALPHA_TEST_ENABLE);
+    shadow_invalidate(SHADOW_BLEND_ENABLE);
     p = pb_push1(p, NV097_SET_COMBINER_SPECULAR_FOG_CW1,
           MASK(NV097_SET_COMBINER_SPECULAR_FOG_CW1_E_SOURCE, _RC_ZERO)   | MASK(NV097_SET_COMBINER_SPECULAR_FOG_CW1_E_ALPHA, 0) | MASK(NV097_SET_COMBINER_SPECULAR_FOG_CW1_E_INVERSE, 0)
         | MASK(NV097_SET_COMBINER_SPECULAR_FOG_CW1_F_SOURCE, _RC_ZERO)   | MASK(NV097_SET_COMBINER_SPECULAR_FOG_CW1_F_ALPHA, 0) | MASK(NV097_SET_COMBINER_SPECULAR_FOG_CW1_F_INVERSE, 0)
         | MASK(NV097_SET_COMBINER_SPECULAR_FOG_CW1_G_SOURCE, _RC_PRIMARY_COLOR) | MASK(NV097_SET_COMBINER_SPECULAR_FOG_CW1_G_ALPHA, 1) | MASK(NV097_SET_COMBINER_SPECULAR_FOG_CW1_G_INVERSE, 0)
         | MASK(NV097_SET_COMBINER_SPECULAR_FOG_CW1_SPECULAR_CLAMP, 0));
-    pb_end(p);
+    pb_commit(p);
   }
 #endif
 
@@ -1766,7 +3025,7 @@ debugPrint("debug stuff");
         | MASK(NV097_SET_COMBINER_SPECULAR_FOG_CW1_F_SOURCE, _RC_ZERO)   | MASK(NV097_SET_COMBINER_SPECULAR_FOG_CW1_F_ALPHA, 0) | MASK(NV097_SET_COMBINER_SPECULAR_FOG_CW1_F_INVERSE, 0)
         | MASK(NV097_SET_COMBINER_SPECULAR_FOG_CW1_G_SOURCE, _RC_ZERO) | MASK(NV097_SET_COMBINER_SPECULAR_FOG_CW1_G_ALPHA, 0) | MASK(NV097_SET_COMBINER_SPECULAR_FOG_CW1_G_INVERSE, 1)
         | MASK(NV097_SET_COMBINER_SPECULAR_FOG_CW1_SPECULAR_CLAMP, 0));
-    pb_end(p);
+    pb_commit(p);
   }
 #endif
 _debugPrint("gone");
@@ -1787,6 +3046,7 @@ GL_API void GL_APIENTRY glTexGeni (GLenum coord, GLenum pname, GLint param) {
     assert(false);
     break;
   }
+  dirty |= DIRTY_TEXTURES;
 }
 
 
@@ -1866,7 +3126,7 @@ GL_API void GL_APIENTRY glClear (GLbitfield mask) {
   p = xgu_set_clear_rect_vertical(p, 0, height);
   p = xgu_set_zstencil_clear_value(p, 0xFFFFFF00); //FIXME: This assumes Z24S8
   p = xgu_clear_surface(p, flags);
-  pb_end(p);
+  pb_commit(p);
 
 
 
@@ -1887,14 +3147,14 @@ GL_API void GL_APIENTRY glClearColor (GLfloat red, GLfloat green, GLfloat blue,
 
   uint32_t* p = pb_begin();
   p = xgu_set_color_clear_value(p, color);
-  pb_end(p);
+  pb_commit(p);
 }
 
 
 // Buffers
 GL_API void GL_APIENTRY glGenBuffers (GLsizei n, GLuint *buffers) {
   Buffer buffer = DEFAULT_BUFFER();
-  gen_objects(n, buffers, &buffer, sizeof(Buffer));
+  gen_objects(n, buffers, OBJECT_TYPE_BUFFER, &buffer);
 }
 
 GL_API void GL_APIENTRY glBindBuffer (GLenum target, GLuint buffer) {
@@ -1902,16 +3162,52 @@ GL_API void GL_APIENTRY glBindBuffer (GLenum target, GLuint buffer) {
   *bound_buffer_store = buffer;
 }
 
-GL_API void GL_APIENTRY glBufferData (GLenum target, GLsizeiptr size, const void *data, GLenum usage) {
-  Buffer* buffer = objects[*get_bound_buffer_store(target)-1].data;
+// Whether draws which the GPU might still be running use the buffer memory
+static bool is_buffer_in_flight(const Buffer* buffer) {
+  return buffer->used && !fence_passed(buffer->use_fence);
+}
+
+// Moves the buffer to fresh memory of `capacity` bytes, keeping the first
+// `keep` bytes; the old memory is retired, so this never waits for the GPU
+static void orphan_buffer_storage(Buffer* buffer, size_t capacity, size_t keep) {
+  uint8_t* data = AllocateResourceMemory(capacity, BUFFER_ALIGNMENT, (void**)&buffer->data);
+  assert(data != NULL);
   if (buffer->data != NULL) {
-    //FIXME: Re-use existing buffer if it's a good fit?
-    assert(false); //FIXME: Assert that this memory is no longer used
-    FreeResourceMemory(buffer->data);
+    //FIXME: Reads back from write-combined memory
+    memcpy(data, buffer->data, MIN(keep, buffer->size));
+    RetireResourceMemory(buffer->data);
+  }
+  buffer->data = data;
+  buffer->capacity = capacity;
+  buffer->used = false;
+
+  // Arrays in this buffer have to be pointed at the new memory
+  dirty |= DIRTY_ATTRIBS;
+}
+
+GL_API void GL_APIENTRY glBufferData (GLenum target, GLsizeiptr size, const void *data, GLenum usage) {
+  Buffer* buffer = get_buffer_object(*get_bound_buffer_store(target));
+  assert((usage == GL_STATIC_DRAW) || (usage == GL_DYNAMIC_DRAW));
+
+  // Dynamic buffers keep their memory if they shrink and grow geometrically,
+  // static buffers are sized exactly
+  bool fits;
+  size_t capacity;
+  if (usage == GL_DYNAMIC_DRAW) {
+    fits = size <= buffer->capacity;
+    capacity = fits ? buffer->capacity : MAX(size, buffer->capacity * 2);
+  } else {
+    fits = size == buffer->capacity;
+    capacity = size;
+  }
+
+  // Memory is only written in place if the GPU is done with it
+  if ((buffer->data == NULL) || !fits || is_buffer_in_flight(buffer)) {
+    orphan_buffer_storage(buffer, capacity, 0);
   }
-  buffer->data = AllocateResourceMemory(size);
   buffer->size = size;
-  assert(buffer->data != NULL);
+  buffer->usage = usage;
+  invalidate_buffer_index_ranges(buffer);
   if (data != NULL) {
     memcpy(buffer->data, data, size);
   } else {
@@ -1920,11 +3216,16 @@ GL_API void GL_APIENTRY glBufferData (GLenum target, GLsizeiptr size, const void
 }
 
 GL_API void GL_APIENTRY glBufferSubData (GLenum target, GLintptr offset, GLsizeiptr size, const void *data) {
-  Buffer* buffer = objects[*get_bound_buffer_store(target)-1].data;
+  Buffer* buffer = get_buffer_object(*get_bound_buffer_store(target));
   assert(buffer->data != NULL);
   assert(buffer->size >= (offset + size));
   assert(data != NULL);
+  if (is_buffer_in_flight(buffer)) {
+    bool replaces_all = (offset == 0) && (size == buffer->size);
+    orphan_buffer_storage(buffer, buffer->capacity, replaces_all ? 0 : buffer->size);
+  }
   memcpy(&buffer->data[offset], data, size);
+  invalidate_buffer_index_ranges(buffer);
 debugPrint("Set %d bytes at %d in %p\n", size, offset, &buffer->data[offset]);
 }
 
@@ -1936,28 +3237,40 @@ GL_API void GL_APIENTRY glDeleteBuffers (GLsizei n, const GLuint *buffers) {
       continue;
     }
 
-    Buffer* buffer = objects[buffers[i]-1].data;
+    Buffer* buffer = get_buffer_object(buffers[i]);
     if (buffer->data != NULL) {
-      unimplemented(); //FIXME: Assert that the data is no longer used
-      FreeResourceMemory(buffer->data);
+      RetireResourceMemory(buffer->data);
+    }
+
+    // Bindings of a deleted buffer revert to zero
+    if (gl_array_buffer == buffers[i]) {
+      gl_array_buffer = 0;
+    }
+    if (gl_element_array_buffer == buffers[i]) {
+      gl_element_array_buffer = 0;
+    }
+    Attrib* attribs[] = {
+      &state.vertex_array, &state.color_array, &state.normal_array,
+      &state.texture_coord_array[0], &state.texture_coord_array[1],
+      &state.texture_coord_array[2], &state.texture_coord_array[3]
+    };
+    for(int j = 0; j < ARRAY_SIZE(attribs); j++) {
+      if (attribs[j]->array.buffer == buffers[i]) {
+        attribs[j]->array.buffer = 0;
+        dirty |= DIRTY_ATTRIBS;
+      }
     }
   }
-  del_objects(n, buffers);
+  del_objects(n, buffers, OBJECT_TYPE_BUFFER);
 }
 
 static void store_attrib_pointer(Attrib* attrib, GLenum gl_type, unsigned int size, size_t stride, const void* pointer) {
-  uintptr_t base;
-  if (gl_array_buffer == 0) {
-    base = 0;
-  } else {
-    Buffer* buffer = objects[gl_array_buffer-1].data;
-    base = (uintptr_t)buffer->data;
-    assert(base != 0);
-  }
   attrib->array.gl_type = gl_type;
   attrib->array.size = size;
   attrib->array.stride = stride;
-  attrib->array.data = (const void*)(base + (uintptr_t)pointer);
+  attrib->array.buffer = gl_array_buffer;
+  attrib->array.data = pointer;
+  dirty |= DIRTY_ATTRIBS;
 }
 
 // Vertex buffers
@@ -2031,10 +3344,12 @@ return; //FIXME: !!!
   }
   f = frame;
 
-  prepare_drawing();
+  // Vertices are submitted in batches of up to 256
+  prepare_drawing(16 + 4 * (count / 256) + PB_STREAM_WORDS);
+  GLint base = stream_client_arrays(first, first + count);
 
 debugPrint("drawarrays");
-  xgux_draw_arrays(gl_to_xgu_primitive_type(mode), first, count);
+  xgux_draw_arrays(gl_to_xgu_primitive_type(mode), first - base, count);
 
 #if 1
   uint32_t* p = pb_begin();
@@ -2046,7 +3361,7 @@ debugPrint("drawarrays");
   p = xgu_end(p);
 #endif
 p = borders(p);
-  pb_end(p);
+  pb_commit(p);
 #endif
 }
 
@@ -2060,14 +3375,15 @@ GL_API void GL_APIENTRY glDrawElements (GLenum mode, GLsizei count, GLenum type,
   }
   f = frame;
 
-  prepare_drawing();
+  // Indices are packed in pairs, with a method header for each batch
+  prepare_drawing(16 + count / 2 + count / 1024 + PB_STREAM_WORDS);
 debugPrint("elements ");
 
   uintptr_t base;
   if (gl_element_array_buffer == 0) {
     base = 0;
   } else {
-    Buffer* buffer = objects[gl_element_array_buffer-1].data;
+    Buffer* buffer = get_buffer_object(gl_element_array_buffer);
     base = (uintptr_t)buffer->data;
     assert(base != 0);
   }
@@ -2076,6 +3392,34 @@ debugPrint("elements ");
   switch(type) {
   case GL_UNSIGNED_SHORT: {
     const uint16_t* indices_ptr = (const uint16_t*)(base + (uintptr_t)indices);
+
+    // Only the range of vertices which is referenced is streamed. The indices
+    // are copied into the pushbuffer, so the rebased ones can be reused.
+    static uint16_t* rebased_indices = NULL;
+    static GLsizei rebased_index_capacity = 0;
+    if ((count > 0) && has_client_arrays()) {
+      uint16_t min_index;
+      uint16_t max_index;
+      if (gl_element_array_buffer != 0) {
+        Buffer* buffer = get_buffer_object(gl_element_array_buffer);
+        get_buffer_index_range16(buffer, (uintptr_t)indices, count, &min_index, &max_index);
+      } else {
+        get_index_range16(indices_ptr, count, &min_index, &max_index);
+      }
+      GLint vertex_base = stream_client_arrays(min_index, max_index + 1);
+      if (vertex_base != 0) {
+        if (count > rebased_index_capacity) {
+          rebased_index_capacity = MAX(rebased_index_capacity * 2, count);
+          rebased_indices = realloc(rebased_indices, rebased_index_capacity * sizeof(uint16_t));
+          assert(rebased_indices != NULL);
+        }
+        for(GLsizei i = 0; i < count; i++) {
+          rebased_indices[i] = indices_ptr[i] - vertex_base;
+        }
+        indices_ptr = rebased_indices;
+      }
+    }
+
     xgux_draw_elements16(gl_to_xgu_primitive_type(mode), indices_ptr, count);
 #if 1
     uint32_t* p = pb_begin();
@@ -2090,7 +3434,7 @@ debugPrint("elements ");
     p = xgu_end(p);
 #endif
 p = borders(p);
-    pb_end(p);
+    pb_commit(p);
 #endif
     break;
   }
@@ -2111,6 +3455,15 @@ p = borders(p);
 
 
 // Matrix functions
+static void matrix_changed() {
+  // Texture matrices are uploaded with the texture units
+  if (matrix_mode == GL_TEXTURE) {
+    dirty |= DIRTY_TEXTURES;
+  } else {
+    dirty |= DIRTY_MATRICES;
+  }
+}
+
 GL_API void GL_APIENTRY glMatrixMode (GLenum mode) {
   CHECK_MATRIX(matrix);
 
@@ -2144,6 +3497,7 @@ GL_API void GL_APIENTRY glMatrixMode (GLenum mode) {
 
 GL_API void GL_APIENTRY glLoadIdentity (void) {
   matrix_identity(matrix);
+  matrix_changed();
 
   CHECK_MATRIX(matrix);
 }
@@ -2160,6 +3514,7 @@ debugPrint("_glMultMatrixf:\n");
   float t[4 * 4];
   matmul4(t, matrix, m);
   memcpy(matrix, t, sizeof(t));
+  matrix_changed();
 
   CHECK_MATRIX(matrix);
 }
@@ -2233,80 +3588,729 @@ GL_API void GL_APIENTRY glPopMatrix (void) {
   assert(*matrix_slot > 0);
   matrix -= 4*4;
   *matrix_slot -= 1;
+  matrix_changed();
+
+  CHECK_MATRIX(matrix);
+}
+
+GL_API void GL_APIENTRY glPushMatrix (void) {
+  CHECK_MATRIX(matrix);
+
+  float* new_matrix = matrix;
+  new_matrix += 4*4;
+  memcpy(new_matrix, matrix, 4*4*sizeof(float));
+  matrix = new_matrix;
+  *matrix_slot += 1;
+  assert(*matrix_slot < 16);
+}
+
+
+// Framebuffer setup
+GL_API void GL_APIENTRY glViewport (GLint x, GLint y, GLsizei width, GLsizei height) {
+  //FIXME: Switch to xgu variant to avoid side-effects
+  debugPrint("%d %d %d %d\n", x, y, width, height);
+  assert(x == 0);
+  assert(y == 0);
+  assert(width == 640); //FIXME: Set up game correctly
+  assert(height == 480); //FIXME: Set up game correctly
+  if (width > 640) { width = 640; } //FIXME: Remove!
+  if (height > 480) { height = 480; } //FIXME: Remove!
+  pb_set_viewport(x, y, width, height, 0.0f, 1.0f);
+}
+
+
+// Textures
+GL_API void GL_APIENTRY glGenTextures (GLsizei n, GLuint *textures) {
+  Texture texture = DEFAULT_TEXTURE();
+  gen_objects(n, textures, OBJECT_TYPE_TEXTURE, &texture);
+}
+
+GL_API void GL_APIENTRY glBindTexture (GLenum target, GLuint texture) {
+  assert(target == GL_TEXTURE_2D);
+  state.texture_binding_2d[active_texture] = texture;
+  dirty |= DIRTY_TEXTURES | DIRTY_TEXENV;
+}
+
+GL_API void GL_APIENTRY glActiveTexture (GLenum texture) {
+  active_texture = texture - GL_TEXTURE0;
+}
+
+GL_API void GL_APIENTRY glClientActiveTexture (GLenum texture) {
+  client_active_texture = texture - GL_TEXTURE0;
+  glMatrixMode(matrix_mode); // Necessary because the matrix pointers are cached
+}
+
+GL_API void GL_APIENTRY glDeleteTextures (GLsizei n, const GLuint *textures) {
+  for(int i = 0; i < n; i++) {
+
+    //FIXME: Also ignore non-existing names
+    if (textures[i] == 0) {
+      continue;
+    }
+
+    Texture* texture = get_texture_object(textures[i]);
+    if (texture->data != NULL) {
+      RetireResourceMemory(texture->data);
+    }
+    if (texture->palette != NULL) {
+      RetireResourceMemory(texture->palette);
+    }
+    reset_texture_saved_size(texture);
+
+    // Bindings of a deleted texture revert to zero
+    for(int j = 0; j < ARRAY_SIZE(state.texture_binding_2d); j++) {
+      if (state.texture_binding_2d[j] == textures[i]) {
+        state.texture_binding_2d[j] = 0;
+      }
+    }
+  }
+  del_objects(n, textures, OBJECT_TYPE_TEXTURE);
+  dirty |= DIRTY_TEXTURES | DIRTY_TEXENV;
+}
+
+// Texture uploads work on square blocks of the top level, so the source is
+// read once and no full size copy is necessary. Each block is converted,
+// swizzled into level 0 and then downscaled into each smaller level while it
+// is still in the cache. The remaining levels are generated from a small
+// image which holds the single texel that is left of each block.
+#define TEXTURE_BLOCK_SIZE 16
+#define TEXTURE_MAX_BYTES_PER_PIXEL 4
+
+// Rows of linear textures are padded to this many bytes
+#define TEXTURE_LINEAR_PITCH_ALIGNMENT 64
+
+// Alignment of texture and palette memory, as required by the hardware
+#define TEXTURE_ALIGNMENT 128
+#define TEXTURE_PALETTE_ALIGNMENT 64
+
+// Largest width or height of downconverted textures, larger levels are dropped
+#ifndef TEXTURE_DOWNCONVERT_MAX_SIZE
+#define TEXTURE_DOWNCONVERT_MAX_SIZE 512
+#endif
+
+// Bytes per texel in the pixels from the application
+static unsigned int get_source_bytes_per_pixel(const Texture* tx) {
+  if ((tx->type == GL_UNSIGNED_BYTE) && (tx->internal_base_format == GL_RGB)) {
+    return 3;
+  }
+  return tx->bytes_per_pixel;
+}
+
+static void convert_texels(const Texture* tx, const uint8_t* src, uint8_t* dst, unsigned int count, unsigned int bytes_per_pixel) {
+  const uint16_t* src16 = (const uint16_t*)src;
+  uint16_t* dst16 = (uint16_t*)dst;
+  if (tx->type == GL_UNSIGNED_SHORT_4_4_4_4) {
+    // RGBA4444 to ARGB4444
+    for(unsigned int i = 0; i < count; i++) {
+      uint16_t v = src16[i];
+      dst16[i] = (v >> 4) | ((v & 0xF) << 12);
+    }
+  } else if (tx->type == GL_UNSIGNED_SHORT_5_5_5_1) {
+    // RGBA5551 to ARGB1555
+    for(unsigned int i = 0; i < count; i++) {
+      uint16_t v = src16[i];
+      dst16[i] = (v >> 1) | ((v & 1) << 15);
+    }
+  } else if (tx->type != GL_UNSIGNED_BYTE) {
+    // RGB565 is already in the hardware layout
+    memcpy(dst, src, count * bytes_per_pixel);
+  } else if (tx->internal_base_format == GL_RGB) {
+    for(unsigned int i = 0; i < count; i++) {
+      dst[0] = src[2];
+      dst[1] = src[1];
+      dst[2] = src[0];
+      dst[3] = 0xFF;
+      dst += 4;
+      src += 3;
+    }
+  } else {
+    memcpy(dst, src, count * bytes_per_pixel);
+  }
+}
+
+// Averages 2x2 texels; if the source is only 1 texel wide or high, 2 texels
+// are averaged instead. Can run in place.
+static void downscale_bytes(unsigned int channels, const uint8_t* src_pixels, unsigned int src_width, unsigned int src_height, size_t src_pitch, uint8_t* dst_pixels, size_t dst_pitch) {
+  unsigned int w = MAX(src_width / 2, 1);
+  unsigned int h = MAX(src_height / 2, 1);
+  size_t dx = (src_width > 1) ? channels : 0;
+  size_t dy = (src_height > 1) ? src_pitch : 0;
+  for(unsigned int y = 0; y < h; y++) {
+    const uint8_t* src = &src_pixels[(y * 2) * src_pitch];
+    uint8_t* dst = &dst_pixels[y * dst_pitch];
+    for(unsigned int x = 0; x < w; x++) {
+      for(unsigned int channel = 0; channel < channels; channel++) {
+        dst[channel] = (src[channel] + src[dx + channel] + src[dy + channel] + src[dy + dx + channel]) / 4;
+      }
+      src += dx * 2;
+      dst += channels;
+    }
+  }
+}
+
+// Averages packed 16-bit texels like `downscale_bytes`. The fields are split
+// into two groups with at least 2 unused bits above each field, so the fields
+// of 4 texels can be summed in one go.
+static void downscale_packed(uint32_t field_mask_a, uint32_t field_mask_b, const uint8_t* src_pixels, unsigned int src_width, unsigned int src_height, size_t src_pitch, uint8_t* dst_pixels, size_t dst_pitch) {
+  unsigned int w = MAX(src_width / 2, 1);
+  unsigned int h = MAX(src_height / 2, 1);
+  size_t dx = (src_width > 1) ? 1 : 0;
+  size_t dy = (src_height > 1) ? (src_pitch / 2) : 0;
+  for(unsigned int y = 0; y < h; y++) {
+    const uint16_t* src = (const uint16_t*)&src_pixels[(y * 2) * src_pitch];
+    uint16_t* dst = (uint16_t*)&dst_pixels[y * dst_pitch];
+    for(unsigned int x = 0; x < w; x++) {
+      uint32_t a = src[0] & field_mask_a;
+      uint32_t b = src[0] & field_mask_b;
+      a += src[dx] & field_mask_a;
+      b += src[dx] & field_mask_b;
+      a += src[dy] & field_mask_a;
+      b += src[dy] & field_mask_b;
+      a += src[dy + dx] & field_mask_a;
+      b += src[dy + dx] & field_mask_b;
+      dst[x] = ((a >> 2) & field_mask_a) | ((b >> 2) & field_mask_b);
+      src += dx * 2;
+    }
+  }
+}
+
+static void downscale_texels(const Texture* tx, const uint8_t* src_pixels, unsigned int src_width, unsigned int src_height, size_t src_pitch, uint8_t* dst_pixels, size_t dst_pitch) {
+  switch(tx->type) {
+  case GL_UNSIGNED_SHORT_5_6_5:
+    downscale_packed(0xF81F, 0x07E0, src_pixels, src_width, src_height, src_pitch, dst_pixels, dst_pitch);
+    break;
+  case GL_UNSIGNED_SHORT_4_4_4_4:
+    downscale_packed(0x0F0F, 0xF0F0, src_pixels, src_width, src_height, src_pitch, dst_pixels, dst_pitch);
+    break;
+  case GL_UNSIGNED_SHORT_5_5_5_1:
+    downscale_packed(0x7C1F, 0x83E0, src_pixels, src_width, src_height, src_pitch, dst_pixels, dst_pitch);
+    break;
+  default:
+    downscale_bytes(tx->bytes_per_pixel, src_pixels, src_width, src_height, src_pitch, dst_pixels, dst_pitch);
+    break;
+  }
+}
+
+// Picks the 16-bit type which keeps most of the texels of a downconverted
+// texture; RGBA with only opaque and transparent texels keeps 5 bits of color
+static GLenum choose_downconverted_type(GLenum format, const uint8_t* pixels, unsigned int count) {
+  if (format == GL_RGB) {
+    return GL_UNSIGNED_SHORT_5_6_5;
+  }
+  assert(format == GL_RGBA);
+  for(unsigned int i = 0; i < count; i++) {
+    uint8_t a = pixels[i * 4 + 3];
+    if ((a != 0x00) && (a != 0xFF)) {
+      return GL_UNSIGNED_SHORT_4_4_4_4;
+    }
+  }
+  return GL_UNSIGNED_SHORT_5_5_5_1;
+}
+
+// Packs RGB8 or RGBA8 texels into `type` in place
+static void downconvert_texels(GLenum type, uint8_t* pixels, unsigned int count) {
+#define QUANTIZE(v, bits) (((v) * ((1 << (bits)) - 1) + 127) / 255)
+  const uint8_t* src = pixels;
+  uint16_t* dst = (uint16_t*)pixels;
+  for(unsigned int i = 0; i < count; i++) {
+    switch(type) {
+    case GL_UNSIGNED_SHORT_5_6_5:
+      dst[i] = (QUANTIZE(src[0], 5) << 11) | (QUANTIZE(src[1], 6) << 5) | QUANTIZE(src[2], 5);
+      src += 3;
+      break;
+    case GL_UNSIGNED_SHORT_4_4_4_4:
+      dst[i] = (QUANTIZE(src[0], 4) << 12) | (QUANTIZE(src[1], 4) << 8) | (QUANTIZE(src[2], 4) << 4) | QUANTIZE(src[3], 4);
+      src += 4;
+      break;
+    case GL_UNSIGNED_SHORT_5_5_5_1:
+      dst[i] = (QUANTIZE(src[0], 5) << 11) | (QUANTIZE(src[1], 5) << 6) | (QUANTIZE(src[2], 5) << 1) | (src[3] >> 7);
+      src += 4;
+      break;
+    default:
+      assert(false);
+      return;
+    }
+  }
+#undef QUANTIZE
+}
+
+// Converts a level of a downconverted texture to 16 bits per texel. Level 0 is
+// also halved until it fits `TEXTURE_DOWNCONVERT_MAX_SIZE`, so all levels move
+// up by the number of dropped levels. Returns NULL if the level was dropped,
+// otherwise a buffer which has to be freed.
+static void* downconvert_texture(Texture* tx, GLint* level, GLenum format, GLenum* type, GLsizei* width, GLsizei* height, const void* pixels) {
+  unsigned int channels = (format == GL_RGB) ? 3 : 4;
+  unsigned int w = *width;
+  unsigned int h = *height;
+  size_t original_size = w * h * 4; // RGB would be padded to 32 bits
+
+  // Only the level 0 from the application decides the layout
+  bool top_level = (*level == 0);
+  unsigned int dropped_levels = 0;
+  if (top_level) {
+    while(MAX(w >> dropped_levels, h >> dropped_levels) > TEXTURE_DOWNCONVERT_MAX_SIZE) {
+      dropped_levels++;
+    }
+    tx->dropped_levels = dropped_levels;
+  } else if (*level < tx->dropped_levels) {
+    return NULL;
+  } else {
+    *level -= tx->dropped_levels;
+  }
+
+  //FIXME: Respect GL pixel packing stuff
+  assert(pixels != NULL);
+  uint8_t* buffer = malloc(w * h * channels);
+  memcpy(buffer, pixels, w * h * channels);
+  for(unsigned int i = 0; i < dropped_levels; i++) {
+    downscale_bytes(channels, buffer, w, h, w * channels, buffer, MAX(w / 2, 1) * channels);
+    w = MAX(w / 2, 1);
+    h = MAX(h / 2, 1);
+  }
+
+  if (top_level) {
+    *type = choose_downconverted_type(format, buffer, w * h);
+  } else {
+    *type = tx->type;
+  }
+  downconvert_texels(*type, buffer, w * h);
+
+  // Keep track of the savings, a level which is specified again replaces its old savings
+  size_t saved_size = original_size - w * h * 2;
+  if (top_level) {
+    debugPrint("Texture %u: %ux%u stored as %ux%u at 16 bits, saved %u KiB\n",
+               state.texture_binding_2d[active_texture],
+               *width, *height, w, h,
+               (unsigned int)(saved_size / 1024));
+  }
+  if (*level < TEXTURE_MAX_LEVELS) {
+    texture_saved_size -= tx->level_saved_size[*level];
+    tx->level_saved_size[*level] = saved_size;
+    texture_saved_size += saved_size;
+  }
+
+  *width = w;
+  *height = h;
+  return buffer;
+}
+
+// Calculates the location of each level of the mipmap chain
+static unsigned int get_texture_levels(const Texture* tx, size_t* level_offset, unsigned int* level_width, unsigned int* level_height, size_t* size) {
+  if (tx->linear) {
+    level_offset[0] = 0;
+    level_width[0] = tx->width;
+    level_height[0] = tx->height;
+    *size = tx->pitch * tx->height;
+    return 1;
+  }
+
+  unsigned int mip_levels = MAX(tx->width_shift, tx->height_shift) + 1;
+  assert(mip_levels <= TEXTURE_MAX_LEVELS);
+  unsigned int bytes_per_pixel = tx->bytes_per_pixel;
+  unsigned int width_shift = tx->width_shift;
+  unsigned int height_shift = tx->height_shift;
+  *size = 0;
+  for(unsigned int mip_level = 0; mip_level < mip_levels; mip_level++) {
+    _debugPrint("%d %d %d\n", mip_level, width_shift, height_shift);
+    level_offset[mip_level] = *size;
+    level_width[mip_level] = 1 << width_shift;
+    level_height[mip_level] = 1 << height_shift;
+    if (tx->compressed_block_size != 0) {
+      // Compressed levels are a linear array of 4x4 blocks
+      *size += ((level_width[mip_level] + 3) / 4) * ((level_height[mip_level] + 3) / 4) * tx->compressed_block_size;
+    } else {
+      *size += (1 << (width_shift + height_shift)) * bytes_per_pixel;
+    }
+    if (width_shift  > 0) { width_shift--;  }
+    if (height_shift > 0) { height_shift--; }
+  }
+  return mip_levels;
+}
+
+// Writes the first `levels` levels of the texture. Level 0 is converted from
+// `pixels`, or read back from the texture if `pixels` is NULL.
+static void build_texture_levels(Texture* tx, const void* pixels, unsigned int levels) {
+  size_t level_offset[TEXTURE_MAX_LEVELS];
+  unsigned int level_width[TEXTURE_MAX_LEVELS];
+  unsigned int level_height[TEXTURE_MAX_LEVELS];
+  size_t size;
+  unsigned int mip_levels = get_texture_levels(tx, level_offset, level_width, level_height, &size);
+  assert(levels <= mip_levels);
+  assert(level_offset[levels - 1] < tx->data_size);
+  unsigned int bytes_per_pixel = tx->bytes_per_pixel;
+  uint8_t* swizzled_pixels = (uint8_t*)tx->data;
+
+  // Levels which fit into a block are generated per block
+  unsigned int block_size = MIN(TEXTURE_BLOCK_SIZE, MIN(tx->width, tx->height));
+  unsigned int block_levels = MIN(__builtin_ctz(block_size) + 1, levels);
+  unsigned int tail_width = tx->width / block_size;
+  unsigned int tail_height = tx->height / block_size;
+  uint8_t* tail = NULL;
+  if (levels > block_levels) {
+    tail = malloc(tail_width * tail_height * bytes_per_pixel);
+  }
+
+  unsigned int src_bytes_per_pixel = get_source_bytes_per_pixel(tx);
+  size_t src_pitch = tx->width * src_bytes_per_pixel;
+
+  uint8_t block[2][TEXTURE_BLOCK_SIZE * TEXTURE_BLOCK_SIZE * TEXTURE_MAX_BYTES_PER_PIXEL];
+  for(unsigned int block_y = 0; block_y < tx->height; block_y += block_size) {
+    for(unsigned int block_x = 0; block_x < tx->width; block_x += block_size) {
+
+      // Copy pixels
+      unsigned int offset = swizzle_rect_offset(block_x, block_y, level_width[0], level_height[0], bytes_per_pixel);
+      if (pixels != NULL) {
+        const uint8_t* src = (const uint8_t*)pixels + block_y * src_pitch + block_x * src_bytes_per_pixel;
+        for(unsigned int y = 0; y < block_size; y++) {
+          convert_texels(tx, src, &block[0][y * block_size * bytes_per_pixel], block_size, bytes_per_pixel);
+          src += src_pitch;
+        }
+        swizzle_rect(block[0], block_size, block_size, &swizzled_pixels[level_offset[0] + offset], block_size * bytes_per_pixel, bytes_per_pixel);
+      } else {
+        //FIXME: Reads back from write-combined memory
+        unswizzle_rect(&swizzled_pixels[level_offset[0] + offset], block_size, block_size, block[0], block_size * bytes_per_pixel, bytes_per_pixel);
+      }
+
+      // Downscale and swizzle data until the block is a single texel
+      unsigned int s = block_size;
+      uint8_t* level_block = block[0];
+      for(unsigned int mip_level = 1; mip_level < block_levels; mip_level++) {
+        uint8_t* next_level_block = block[mip_level % 2];
+        s /= 2;
+        downscale_texels(tx, level_block, s * 2, s * 2, s * 2 * bytes_per_pixel, next_level_block, s * bytes_per_pixel);
+        level_block = next_level_block;
+        _debugPrint("Swizzling %dx%d block at %d,%d (%d / %d)\n", s, s, block_x >> mip_level, block_y >> mip_level, mip_level, levels);
+        offset = swizzle_rect_offset(block_x >> mip_level, block_y >> mip_level, level_width[mip_level], level_height[mip_level], bytes_per_pixel);
+        swizzle_rect(level_block, s, s, &swizzled_pixels[level_offset[mip_level] + offset], s * bytes_per_pixel, bytes_per_pixel);
+      }
+
+      if (tail != NULL) {
+        unsigned int tail_index = (block_y / block_size) * tail_width + (block_x / block_size);
+        memcpy(&tail[tail_index * bytes_per_pixel], level_block, bytes_per_pixel);
+      }
+
+    }
+  }
+
+  // Generate the remaining levels; we can run the downscale in place
+  for(unsigned int mip_level = block_levels; mip_level < levels; mip_level++) {
+    unsigned int w = level_width[mip_level];
+    unsigned int h = level_height[mip_level];
+    _debugPrint("Downscaling to %dx%d\n", w, h);
+    downscale_texels(tx, tail, level_width[mip_level - 1], level_height[mip_level - 1], level_width[mip_level - 1] * bytes_per_pixel, tail, w * bytes_per_pixel);
+    swizzle_rect(tail, w, h, &swizzled_pixels[level_offset[mip_level]], w * bytes_per_pixel, bytes_per_pixel);
+  }
+  _debugPrint("Generated %d levels!\n", levels);
+
+  free(tail);
+
+  tx->level_mask |= (1 << levels) - 1;
+}
+
+// Whether draws which the GPU might still be running use the texture memory
+static bool is_texture_in_flight(const Texture* tx) {
+  return tx->sampled && !fence_passed(tx->sample_fence);
+}
+
+// Makes sure the texture memory can hold `size` bytes and can be written;
+// the first `keep` bytes are preserved if the texture has to be moved.
+// Memory which is still in flight is renamed instead of waiting for the GPU,
+// the next draw will then pick up the new location.
+static void reserve_texture_storage(Texture* tx, size_t size, size_t keep) {
+  bool in_flight = is_texture_in_flight(tx);
+  if ((tx->data != NULL) && (size <= tx->data_size) && !in_flight) {
+    return;
+  }
+  size = MAX(size, MIN(keep, tx->data_size));
+  void* data = AllocateResourceMemory(size, TEXTURE_ALIGNMENT, &tx->data);
+  if (tx->data != NULL) {
+    //FIXME: Reads back from write-combined memory
+    memcpy(data, tx->data, MIN(keep, tx->data_size));
+    RetireResourceMemory(tx->data);
+  }
+  tx->data = data;
+  tx->data_size = size;
+  tx->sampled = false;
+  dirty |= DIRTY_TEXTURES;
+}
+
+// Makes the texture memory writable for replacing `width` x `height` texels
+// of `level`; nothing has to be preserved if this covers the only level
+static void prepare_texture_update(Texture* tx, GLint level, GLsizei width, GLsizei height) {
+  bool replaces_all = (level == 0) && (tx->level_mask == 1) && (width == tx->width) && (height == tx->height);
+  reserve_texture_storage(tx, tx->data_size, replaces_all ? 0 : tx->data_size);
+}
+
+// Builds missing mipmaps from level 0, growing the texture memory if necessary
+static void generate_texture_mipmaps(Texture* tx) {
+  size_t level_offset[TEXTURE_MAX_LEVELS];
+  unsigned int level_width[TEXTURE_MAX_LEVELS];
+  unsigned int level_height[TEXTURE_MAX_LEVELS];
+  size_t size;
+  unsigned int mip_levels = get_texture_levels(tx, level_offset, level_width, level_height, &size);
+
+  // Levels from the application are never replaced
+  //FIXME: Compressed textures would have to be decoded and encoded again
+  if (tx->explicit_mipmaps || (tx->compressed_block_size != 0) || (get_valid_levels(tx) >= mip_levels)) {
+    return;
+  }
+
+  // Palette indices can't be averaged
+  if (tx->format == XGU_TEXTURE_FORMAT_I8_A8R8G8B8_SWIZZLED) {
+    return;
+  }
+  assert(tx->level_mask & 1);
+
+  reserve_texture_storage(tx, size, level_offset[1]);
+  build_texture_levels(tx, NULL, mip_levels);
+}
+
+// Sets up the layout of a texture for a new level 0
+static void set_texture_layout(Texture* tx, GLenum internal_base_format, GLenum type, unsigned int format, GLsizei width, GLsizei height, unsigned int bpp, unsigned int compressed_block_size) {
+
+  // Sizes which are not a power of two are stored linearly
+  bool linear = ((width & (width - 1)) != 0) || ((height & (height - 1)) != 0);
+  if (linear) {
+    assert(compressed_block_size == 0);
+    format = get_linear_texture_format(format);
+  }
 
-  CHECK_MATRIX(matrix);
-}
+  // Levels from the application stay valid if the layout of level 0 is kept
+  if ((tx->data == NULL) || (width != tx->width) || (height != tx->height) || (format != tx->format)) {
+    tx->explicit_mipmaps = false;
+    tx->level_mask = 0;
+  }
 
-GL_API void GL_APIENTRY glPushMatrix (void) {
-  CHECK_MATRIX(matrix);
+  tx->internal_base_format = internal_base_format;
+  tx->type = type;
+  tx->format = format;
+  tx->compressed_block_size = compressed_block_size;
+  tx->bytes_per_pixel = bpp / 8;
+  tx->linear = linear;
+  tx->width = width;
+  tx->height = height;
 
-  float* new_matrix = matrix;
-  new_matrix += 4*4;
-  memcpy(new_matrix, matrix, 4*4*sizeof(float));
-  matrix = new_matrix;
-  *matrix_slot += 1;
-  assert(*matrix_slot < 16);
-}
+  if (linear) {
+    // There's only a single level, so the size is not encoded in the format
+    tx->width_shift = 0;
+    tx->height_shift = 0;
+    tx->pitch = (width * tx->bytes_per_pixel + TEXTURE_LINEAR_PITCH_ALIGNMENT - 1) & ~(TEXTURE_LINEAR_PITCH_ALIGNMENT - 1);
+    return;
+  }
 
+  tx->width_shift = __builtin_ffs(width) - 1;
+  tx->height_shift = __builtin_ffs(height) - 1;
+  debugPrint("%d = %d [%d]\n", width, 1 << tx->width_shift, tx->width_shift);
+  debugPrint("%d = %d [%d]\n", height, 1 << tx->height_shift, tx->height_shift);
+  assert(width == (1 << tx->width_shift));
+  assert(height == (1 << tx->height_shift));
 
-// Framebuffer setup
-GL_API void GL_APIENTRY glViewport (GLint x, GLint y, GLsizei width, GLsizei height) {
-  //FIXME: Switch to xgu variant to avoid side-effects
-  debugPrint("%d %d %d %d\n", x, y, width, height);
-  assert(x == 0);
-  assert(y == 0);
-  assert(width == 640); //FIXME: Set up game correctly
-  assert(height == 480); //FIXME: Set up game correctly
-  if (width > 640) { width = 640; } //FIXME: Remove!
-  if (height > 480) { height = 480; } //FIXME: Remove!
-  pb_set_viewport(x, y, width, height, 0.0f, 1.0f);
+  if (compressed_block_size != 0) {
+    tx->pitch = ((width + 3) / 4) * compressed_block_size;
+  } else {
+    tx->pitch = width * bpp / 8;
+  }
 }
 
+// Writes texels to a rectangle of a linear texture
+static void write_linear_texels(Texture* tx, unsigned int x, unsigned int y, unsigned int width, unsigned int height, const void* pixels) {
+  unsigned int bytes_per_pixel = tx->bytes_per_pixel;
+  size_t src_pitch = width * get_source_bytes_per_pixel(tx);
+  const uint8_t* src = pixels;
+  uint8_t* dst = &((uint8_t*)tx->data)[y * tx->pitch + x * bytes_per_pixel];
 
-// Textures
-GL_API void GL_APIENTRY glGenTextures (GLsizei n, GLuint *textures) {
-  Texture texture = DEFAULT_TEXTURE();
-  gen_objects(n, textures, &texture, sizeof(Texture));
-}
+  //FIXME: Respect GL pixel packing stuff
+  assert(pixels != NULL);
 
-GL_API void GL_APIENTRY glBindTexture (GLenum target, GLuint texture) {
-  assert(target == GL_TEXTURE_2D);
-  state.texture_binding_2d[active_texture] = texture;
-}
+  // Full rows without padding can be written in one go
+  if ((width == tx->width) && (tx->pitch == width * bytes_per_pixel)) {
+    convert_texels(tx, src, dst, width * height, bytes_per_pixel);
+    return;
+  }
 
-GL_API void GL_APIENTRY glActiveTexture (GLenum texture) {
-  active_texture = texture - GL_TEXTURE0;
+  for(unsigned int row = 0; row < height; row++) {
+    convert_texels(tx, src, dst, width, bytes_per_pixel);
+    src += src_pitch;
+    dst += tx->pitch;
+  }
 }
 
-GL_API void GL_APIENTRY glClientActiveTexture (GLenum texture) {
-  client_active_texture = texture - GL_TEXTURE0;
-  glMatrixMode(matrix_mode); // Necessary because the matrix pointers are cached
+// Converts `entries` palette entries of a GL_PALETTE*_OES texture to A8R8G8B8
+static void convert_palette(GLenum internalformat, const uint8_t* src, unsigned int entries, uint32_t* dst) {
+  for(unsigned int i = 0; i < entries; i++) {
+    unsigned int r, g, b, a;
+    uint16_t v = src[0] | (src[1] << 8);
+    switch(internalformat) {
+    case GL_PALETTE4_RGB8_OES:
+    case GL_PALETTE8_RGB8_OES:
+      r = src[0];
+      g = src[1];
+      b = src[2];
+      a = 0xFF;
+      src += 3;
+      break;
+    case GL_PALETTE4_RGBA8_OES:
+    case GL_PALETTE8_RGBA8_OES:
+      r = src[0];
+      g = src[1];
+      b = src[2];
+      a = src[3];
+      src += 4;
+      break;
+    case GL_PALETTE4_R5_G6_B5_OES:
+    case GL_PALETTE8_R5_G6_B5_OES:
+      r = ((v >> 11) & 0x1F) * 0xFF / 0x1F;
+      g = ((v >> 5) & 0x3F) * 0xFF / 0x3F;
+      b = (v & 0x1F) * 0xFF / 0x1F;
+      a = 0xFF;
+      src += 2;
+      break;
+    case GL_PALETTE4_RGBA4_OES:
+    case GL_PALETTE8_RGBA4_OES:
+      r = ((v >> 12) & 0xF) * 0x11;
+      g = ((v >> 8) & 0xF) * 0x11;
+      b = ((v >> 4) & 0xF) * 0x11;
+      a = (v & 0xF) * 0x11;
+      src += 2;
+      break;
+    case GL_PALETTE4_RGB5_A1_OES:
+    case GL_PALETTE8_RGB5_A1_OES:
+      r = ((v >> 11) & 0x1F) * 0xFF / 0x1F;
+      g = ((v >> 6) & 0x1F) * 0xFF / 0x1F;
+      b = ((v >> 1) & 0x1F) * 0xFF / 0x1F;
+      a = (v & 1) ? 0xFF : 0x00;
+      src += 2;
+      break;
+    default:
+      assert(false);
+      return;
+    }
+    dst[i] = (a << 24) | (r << 16) | (g << 8) | b;
+  }
 }
 
-GL_API void GL_APIENTRY glDeleteTextures (GLsizei n, const GLuint *textures) {
-  for(int i = 0; i < n; i++) {
+// Uploads a GL_PALETTE*_OES texture as 8-bit indices into a 256 entry palette.
+// A negative `level` means that the data holds `1 - level` levels.
+static void upload_paletted_texture(Texture* tx, GLint level, GLenum internalformat, GLsizei width, GLsizei height, GLsizei imageSize, const void* data) {
+  assert(level <= 0);
+  unsigned int levels = 1 - level;
 
-    //FIXME: Also ignore non-existing names
-    if (textures[i] == 0) {
-      continue;
-    }
+  GLenum internal_base_format;
+  unsigned int entry_size;
+  switch(internalformat) {
+  case GL_PALETTE4_RGB8_OES:      case GL_PALETTE8_RGB8_OES:      internal_base_format = GL_RGB;  entry_size = 3; break;
+  case GL_PALETTE4_RGBA8_OES:     case GL_PALETTE8_RGBA8_OES:     internal_base_format = GL_RGBA; entry_size = 4; break;
+  case GL_PALETTE4_R5_G6_B5_OES:  case GL_PALETTE8_R5_G6_B5_OES:  internal_base_format = GL_RGB;  entry_size = 2; break;
+  case GL_PALETTE4_RGBA4_OES:     case GL_PALETTE8_RGBA4_OES:     internal_base_format = GL_RGBA; entry_size = 2; break;
+  case GL_PALETTE4_RGB5_A1_OES:   case GL_PALETTE8_RGB5_A1_OES:   internal_base_format = GL_RGBA; entry_size = 2; break;
+  default:
+    assert(false);
+    return;
+  }
+  bool wide_indices = (internalformat >= GL_PALETTE8_RGB8_OES);
+  unsigned int entries = wide_indices ? 256 : 16;
 
-    Texture* texture = objects[textures[i]-1].data;
-    if (texture->data != NULL) {
-      unimplemented(); //FIXME: Assert that the data is no longer used
-      FreeResourceMemory(texture->data);
+  reset_texture_saved_size(tx);
+  set_texture_layout(tx, internal_base_format, GL_UNSIGNED_BYTE, XGU_TEXTURE_FORMAT_I8_A8R8G8B8_SWIZZLED, width, height, 1*8, 0);
+  assert(!tx->linear);
+
+  size_t level_offset[TEXTURE_MAX_LEVELS];
+  unsigned int level_width[TEXTURE_MAX_LEVELS];
+  unsigned int level_height[TEXTURE_MAX_LEVELS];
+  size_t size;
+  unsigned int mip_levels = get_texture_levels(tx, level_offset, level_width, level_height, &size);
+  assert(levels <= mip_levels);
+  if (levels < mip_levels) {
+    size = level_offset[levels];
+  }
+
+  // Indices are tightly packed, 4-bit indices start in the high nibble
+  size_t index_size = 0;
+  for(unsigned int mip_level = 0; mip_level < levels; mip_level++) {
+    size_t texels = level_width[mip_level] * level_height[mip_level];
+    index_size += wide_indices ? texels : ((texels + 1) / 2);
+  }
+  assert(imageSize == entries * entry_size + index_size);
+
+  // The palette is renamed along with the indices
+  if ((tx->palette != NULL) && is_texture_in_flight(tx)) {
+    RetireResourceMemory(tx->palette);
+    tx->palette = NULL;
+  }
+  if (tx->palette == NULL) {
+    tx->palette = AllocateResourceMemory(256 * 4, TEXTURE_PALETTE_ALIGNMENT, (void**)&tx->palette);
+  }
+  assert(data != NULL);
+  const uint8_t* src = data;
+  convert_palette(internalformat, src, entries, tx->palette);
+  src += entries * entry_size;
+
+  reserve_texture_storage(tx, size, 0);
+
+  uint8_t* tmp = wide_indices ? NULL : malloc(level_width[0] * level_height[0]);
+  for(unsigned int mip_level = 0; mip_level < levels; mip_level++) {
+    unsigned int w = level_width[mip_level];
+    unsigned int h = level_height[mip_level];
+    uint8_t* dst = &((uint8_t*)tx->data)[level_offset[mip_level]];
+    if (wide_indices) {
+      swizzle_rect(src, w, h, dst, w, 1);
+      src += w * h;
+    } else {
+      for(unsigned int i = 0; i < w * h; i++) {
+        tmp[i] = (i & 1) ? (src[i / 2] & 0xF) : (src[i / 2] >> 4);
+      }
+      swizzle_rect(tmp, w, h, dst, w, 1);
+      src += (w * h + 1) / 2;
     }
   }
-  del_objects(n, textures);
+  free(tmp);
+
+  // Indices can't be averaged, so all levels come from the application
+  tx->level_mask = (1 << levels) - 1;
+  tx->explicit_mipmaps = (levels > 1);
 }
 
-static void blend_2x2_bytes(unsigned int channels, const uint8_t* src_pixels, uint8_t* dst_pixels, unsigned int x, unsigned int y, size_t src_pitch, size_t dst_pitch) {
-  for(int channel = 0; channel < channels; channel++) {
-    dst_pixels[y * dst_pitch + x*channels + channel] = (src_pixels[(y*2+0) * src_pitch + (x*2+0)*channels + channel] +
-                                                        src_pixels[(y*2+0) * src_pitch + (x*2+1)*channels + channel] +
-                                                        src_pixels[(y*2+1) * src_pitch + (x*2+0)*channels + channel] +
-                                                        src_pixels[(y*2+1) * src_pitch + (x*2+1)*channels + channel]) / 4;
+// Writes a level above 0 which was supplied by the application into its slot
+// of the mipmap chain
+static void upload_texture_level(Texture* tx, GLint level, unsigned int format, GLsizei width, GLsizei height, const void* pixels) {
+
+  // The layout of the chain is only known once level 0 was specified
+  //FIXME: Keep such levels until level 0 arrives?
+  if (!(tx->level_mask & 1)) {
+    debugPrint("Ignoring level %d which was specified before level 0\n", level);
+    return;
+  }
+
+  size_t level_offset[TEXTURE_MAX_LEVELS];
+  unsigned int level_width[TEXTURE_MAX_LEVELS];
+  unsigned int level_height[TEXTURE_MAX_LEVELS];
+  size_t size;
+  unsigned int mip_levels = get_texture_levels(tx, level_offset, level_width, level_height, &size);
+
+  // Levels which are inconsistent with level 0 leave the texture incomplete in GL
+  if ((format != tx->format) || (level >= mip_levels) || (width != level_width[level]) || (height != level_height[level])) {
+    debugPrint("Ignoring level %d which doesn't match level 0\n", level);
+    return;
+  }
+
+  // Make room for the entire chain, as the other levels will likely follow
+  reserve_texture_storage(tx, size, tx->data_size);
+
+  //FIXME: Respect GL pixel packing stuff
+  assert(pixels != NULL);
+  unsigned int bytes_per_pixel = tx->bytes_per_pixel;
+  unsigned int src_bytes_per_pixel = get_source_bytes_per_pixel(tx);
+  uint8_t* tmp = malloc(width * height * bytes_per_pixel);
+  const uint8_t* src = pixels;
+  for(unsigned int y = 0; y < height; y++) {
+    convert_texels(tx, src, &tmp[y * width * bytes_per_pixel], width, bytes_per_pixel);
+    src += width * src_bytes_per_pixel;
   }
+  swizzle_rect(tmp, width, height, &((uint8_t*)tx->data)[level_offset[level]], width * bytes_per_pixel, bytes_per_pixel);
+  free(tmp);
+
+  tx->level_mask |= 1 << level;
+  tx->explicit_mipmaps = true;
 }
 
 GL_API void GL_APIENTRY glTexImage2D (GLenum target, GLint level, GLint internalformat, GLsizei width, GLsizei height, GLint border, GLenum format, GLenum type, const void *pixels) {
@@ -2315,140 +4319,357 @@ GL_API void GL_APIENTRY glTexImage2D (GLenum target, GLint level, GLint internal
 
   Texture* tx = get_bound_texture(active_texture);
 
-  if (level > 0) {
-    unimplemented();
-    return;
+  dirty |= DIRTY_TEXTURES | DIRTY_TEXENV;
+
+  // Trade fidelity for memory if requested
+  bool downconvert = (type == GL_UNSIGNED_BYTE) && ((format == GL_RGB) || (format == GL_RGBA));
+  if (level == 0) {
+    tx->downconverted = downconvert && (texture_downconvert_hint == GL_FASTEST);
+    tx->dropped_levels = 0;
+    reset_texture_saved_size(tx);
+  }
+  void* downconverted_pixels = NULL;
+  if (downconvert && tx->downconverted) {
+    downconverted_pixels = downconvert_texture(tx, &level, format, &type, &width, &height, pixels);
+    if (downconverted_pixels == NULL) {
+      return;
+    }
+    pixels = downconverted_pixels;
   }
 
+  GLenum internal_base_format;
   unsigned int bpp;
 
   switch(internalformat) {
   case GL_LUMINANCE:
     assert(format == GL_LUMINANCE);
     assert(type == GL_UNSIGNED_BYTE);
-    tx->internal_base_format = GL_LUMINANCE;
+    internal_base_format = GL_LUMINANCE;
     bpp = 1*8;
     break;
   case GL_LUMINANCE_ALPHA:
     assert(format == GL_LUMINANCE_ALPHA);
     assert(type == GL_UNSIGNED_BYTE);
-    tx->internal_base_format = GL_LUMINANCE_ALPHA;
+    internal_base_format = GL_LUMINANCE_ALPHA;
     bpp = 2*8;
     break;
   case GL_RGB:
     assert(format == GL_RGB);
+    if (type == GL_UNSIGNED_SHORT_5_6_5) {
+      internal_base_format = GL_RGB;
+      bpp = 2*8;
+      break;
+    }
     assert(type == GL_UNSIGNED_BYTE);
-    tx->internal_base_format = GL_RGB;
+    internal_base_format = GL_RGB;
     bpp = 4*8; // 3*8 in GL, but we have to pad this
     break;
   case GL_RGBA:
     assert(format == GL_RGBA);
+    if ((type == GL_UNSIGNED_SHORT_4_4_4_4) || (type == GL_UNSIGNED_SHORT_5_5_5_1)) {
+      internal_base_format = GL_RGBA;
+      bpp = 2*8;
+      break;
+    }
     assert(type == GL_UNSIGNED_BYTE);
-    tx->internal_base_format = GL_RGBA;
+    internal_base_format = GL_RGBA;
     bpp = 4*8;
     break;
   default:
-    tx->internal_base_format = -1;
+    internal_base_format = -1;
     bpp = 0;
     unimplemented("%d", internalformat);
     assert(false);
     return;
   }
 
-  tx->width_shift = __builtin_ffs(width) - 1;
-  tx->height_shift = __builtin_ffs(height) - 1;
-  debugPrint("%d = %d [%d]\n", width, 1 << tx->width_shift, tx->width_shift);
-  debugPrint("%d = %d [%d]\n", height, 1 << tx->height_shift, tx->height_shift);
-  assert(width == (1 << tx->width_shift));
-  assert(height == (1 << tx->height_shift));
+  unsigned int xgu_format;
+  if (type == GL_UNSIGNED_BYTE) {
+    xgu_format = gl_to_xgu_texture_format(internal_base_format);
+  } else {
+    xgu_format = gl_to_xgu_packed_texture_format(type);
+  }
 
-  tx->width = width;
-  tx->height = height;
-  tx->pitch = width * bpp / 8;
-  if (tx->data != NULL) {
-    //FIXME: Re-use existing buffer if it's a good fit?
-    //FIXME: Assert that this memory is no longer used
-    FreeResourceMemory(tx->data);
+  if (level > 0) {
+    upload_texture_level(tx, level, xgu_format, width, height, pixels);
+    free(downconverted_pixels);
+    return;
   }
 
-  // Calculate required size for mipmaps
-  unsigned int mip_levels = MAX(tx->width_shift, tx->height_shift) + 1;
-  unsigned int width_shift = tx->width_shift;
-  unsigned int height_shift = tx->height_shift;
-  size_t size = 0;
-  for(unsigned int mip_level = 0; mip_level < mip_levels; mip_level++) {
-    debugPrint("%d %d %d\n", mip_level, width_shift, height_shift);
-    size += (1 << (width_shift + height_shift)) * (bpp / 8);
-    if (width_shift  > 0) { width_shift--;  }
-    if (height_shift > 0) { height_shift--; }
+  set_texture_layout(tx, internal_base_format, type, xgu_format, width, height, bpp, 0);
+
+  // Calculate required size and location of mipmaps
+  size_t level_offset[TEXTURE_MAX_LEVELS];
+  unsigned int level_width[TEXTURE_MAX_LEVELS];
+  unsigned int level_height[TEXTURE_MAX_LEVELS];
+  size_t size;
+  unsigned int mip_levels = get_texture_levels(tx, level_offset, level_width, level_height, &size);
+
+  // Linear textures only have a single level which is not swizzled
+  if (tx->linear) {
+    reserve_texture_storage(tx, size, 0);
+    write_linear_texels(tx, 0, 0, width, height, pixels);
+    tx->level_mask = 1;
+    free(downconverted_pixels);
+    return;
+  }
+
+  // Only build mipmaps now if they will be sampled
+  unsigned int levels = 1;
+  if (tx->generate_mipmap && is_mipmap_filter(tx->min_filter) && !tx->explicit_mipmaps) {
+    levels = mip_levels;
+  }
+  if ((levels < mip_levels) && !tx->explicit_mipmaps) {
+    size = level_offset[levels];
   }
-  tx->data = AllocateResourceMemory(size);
 
-  // Allocate temporary space for generating mipmaps and swizzling source
-  uint8_t* tmp = malloc(tx->width * tx->height * (bpp / 8));
+  // Re-use the existing buffer if the new mipmap chain fits
+  reserve_texture_storage(tx, size, tx->explicit_mipmaps ? tx->data_size : 0);
 
-  // Copy pixels
   //FIXME: Respect GL pixel packing stuff
   assert(pixels != NULL);
-  if (tx->internal_base_format == GL_RGB) {
-    assert(format == GL_RGB);
-    assert(type == GL_UNSIGNED_BYTE);
-    const uint8_t* src = pixels;
-    uint8_t* dst = tmp;
-    assert(tx->pitch == tx->width * 4);
-    for(int y = 0; y < tx->height; y++) {
-      for(int x = 0; x < tx->width; x++) {
-        dst[0] = src[2];
-        dst[1] = src[1];
-        dst[2] = src[0];
-        dst[3] = 0xFF;
-        dst += 4;
-        src += 3;
-      }
+  build_texture_levels(tx, pixels, levels);
+
+  free(downconverted_pixels);
+}
+
+GL_API void GL_APIENTRY glTexSubImage2D (GLenum target, GLint level, GLint xoffset, GLint yoffset, GLsizei width, GLsizei height, GLenum format, GLenum type, const void *pixels) {
+  assert(target == GL_TEXTURE_2D);
+
+  Texture* tx = get_bound_texture(active_texture);
+
+  // Updates of downconverted textures are converted the same way
+  void* downconverted_pixels = NULL;
+  if (tx->downconverted && (type == GL_UNSIGNED_BYTE)) {
+    if (level < tx->dropped_levels) {
+      //FIXME: Could be downscaled into the remaining levels
+      unimplemented("Update of dropped level %d", level);
+      return;
     }
-  } else {
-    memcpy(tmp, pixels, tx->width * tx->height * (bpp / 8));
+    level -= tx->dropped_levels;
+    unsigned int channels = (format == GL_RGB) ? 3 : 4;
+    assert(pixels != NULL);
+    downconverted_pixels = malloc(width * height * channels);
+    memcpy(downconverted_pixels, pixels, width * height * channels);
+    downconvert_texels(tx->type, downconverted_pixels, width * height);
+    pixels = downconverted_pixels;
+    type = tx->type;
   }
 
-  // Generate mipmaps
-  unimplemented(); //FIXME: Make dependent on GL_GENERATE_MIPMAP_SGIS
-  uint8_t* swizzled_pixels = (uint8_t*)tx->data;
-  unsigned int w = 1 << tx->width_shift;
-  unsigned int h = 1 << tx->height_shift;
-  size_t pitch = w * (bpp / 8);
-  unsigned int mip_level = 0;
-  while(true) {
-
-    // Swizzle data
-    _debugPrint("Swizzling %dx%d [pitch %d, %dbpp] (%d / %d)\n", w, h, pitch, bpp, mip_level, mip_levels);
-    swizzle_rect(tmp, w, h, swizzled_pixels, pitch, bpp / 8);
-
-    // Check if there is another mipmap level
-    mip_level++;
-    if (mip_level >= mip_levels) {
-      _debugPrint("Generated all levels!\n");
-      break;
-    }
+  size_t level_offset[TEXTURE_MAX_LEVELS];
+  unsigned int level_width[TEXTURE_MAX_LEVELS];
+  unsigned int level_height[TEXTURE_MAX_LEVELS];
+  size_t size;
+  unsigned int mip_levels = get_texture_levels(tx, level_offset, level_width, level_height, &size);
+
+  assert(tx->data != NULL);
+  assert(tx->compressed_block_size == 0);
+  assert(tx->format != XGU_TEXTURE_FORMAT_I8_A8R8G8B8_SWIZZLED);
+  assert(level < mip_levels);
+  assert(tx->level_mask & (1 << level));
+  assert(format == tx->internal_base_format);
+  assert(type == tx->type);
+  assert(xoffset >= 0);
+  assert(yoffset >= 0);
+  assert(xoffset + width <= level_width[level]);
+  assert(yoffset + height <= level_height[level]);
+  if ((width == 0) || (height == 0)) {
+    free(downconverted_pixels);
+    return;
+  }
 
-    // Calculate offset and size of next mipmap level
-    swizzled_pixels += pitch * h;
-    size_t src_pitch = pitch;
-    if (w > 1) { w /= 2; pitch /= 2; }
-    if (h > 1) { h /= 2; }
+  //FIXME: Texture cache might have to be invalidated
+  prepare_texture_update(tx, level, width, height);
+  dirty |= DIRTY_TEXTURES;
 
-    // We can run the downscale in place
-    _debugPrint("Downscaling to %dx%d\n", w, h);
-    for(unsigned int y = 0; y < h; y++) {
-      for(unsigned int x = 0; x < w; x++) {
-        blend_2x2_bytes(bpp / 8, tmp, tmp, x, y, src_pitch, pitch);
-      }
-    }
+  if (tx->linear) {
+    write_linear_texels(tx, xoffset, yoffset, width, height, pixels);
+    free(downconverted_pixels);
+    return;
+  }
 
+  unsigned int bytes_per_pixel = tx->bytes_per_pixel;
+  uint8_t* swizzled_pixels = (uint8_t*)tx->data;
+
+  // Large enough for the region and the texels around it in the next level
+  uint8_t* tmp = malloc((width + 2) * (height + 2) * bytes_per_pixel);
 
+  // Copy pixels
+  //FIXME: Respect GL pixel packing stuff
+  assert(pixels != NULL);
+  unsigned int src_bytes_per_pixel = get_source_bytes_per_pixel(tx);
+  const uint8_t* src = pixels;
+  for(unsigned int y = 0; y < height; y++) {
+    convert_texels(tx, src, &tmp[y * width * bytes_per_pixel], width, bytes_per_pixel);
+    src += width * src_bytes_per_pixel;
+  }
+  swizzle_subrect(tmp, xoffset, yoffset, width, height, &swizzled_pixels[level_offset[level]], width * bytes_per_pixel, level_width[level], level_height[level], bytes_per_pixel);
 
+  // Only update the texels of smaller levels which depend on the region
+  if ((level > 0) || !tx->generate_mipmap || tx->explicit_mipmaps) {
+    mip_levels = 1;
+  }
+  mip_levels = MIN(mip_levels, get_valid_levels(tx));
+  unsigned int x0 = xoffset;
+  unsigned int y0 = yoffset;
+  unsigned int x1 = xoffset + width;
+  unsigned int y1 = yoffset + height;
+  for(unsigned int mip_level = 1; mip_level < mip_levels; mip_level++) {
+
+    // Widen the region to full 2x2 groups of the previous level
+    unsigned int src_width = level_width[mip_level - 1];
+    unsigned int src_height = level_height[mip_level - 1];
+    x0 &= ~1;
+    y0 &= ~1;
+    x1 = MIN((x1 + 1) & ~1, src_width);
+    y1 = MIN((y1 + 1) & ~1, src_height);
+    unsigned int w = x1 - x0;
+    unsigned int h = y1 - y0;
+
+    //FIXME: Reads back from write-combined memory
+    unswizzle_subrect(&swizzled_pixels[level_offset[mip_level - 1]], x0, y0, w, h, src_width, src_height, tmp, w * bytes_per_pixel, bytes_per_pixel);
+
+    x0 /= 2;
+    y0 /= 2;
+    x1 = x0 + MAX(w / 2, 1);
+    y1 = y0 + MAX(h / 2, 1);
+    downscale_texels(tx, tmp, w, h, w * bytes_per_pixel, tmp, (x1 - x0) * bytes_per_pixel);
+    swizzle_subrect(tmp, x0, y0, x1 - x0, y1 - y0, &swizzled_pixels[level_offset[mip_level]], (x1 - x0) * bytes_per_pixel, level_width[mip_level], level_height[mip_level], bytes_per_pixel);
   }
 
   free(tmp);
+  free(downconverted_pixels);
+}
+
+GL_API void GL_APIENTRY glCompressedTexImage2D (GLenum target, GLint level, GLenum internalformat, GLsizei width, GLsizei height, GLint border, GLsizei imageSize, const void *data) {
+  assert(target == GL_TEXTURE_2D);
+  assert(border == 0);
+
+  Texture* tx = get_bound_texture(active_texture);
+
+  dirty |= DIRTY_TEXTURES | DIRTY_TEXENV;
+
+  GLenum internal_base_format;
+  unsigned int block_size;
+
+  switch(internalformat) {
+  case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+    internal_base_format = GL_RGB;
+    block_size = 8;
+    break;
+  case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
+    internal_base_format = GL_RGBA;
+    block_size = 8;
+    break;
+  case GL_COMPRESSED_RGBA_S3TC_DXT3_EXT:
+  case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+    internal_base_format = GL_RGBA;
+    block_size = 16;
+    break;
+  case GL_PALETTE4_RGB8_OES:
+  case GL_PALETTE4_RGBA8_OES:
+  case GL_PALETTE4_R5_G6_B5_OES:
+  case GL_PALETTE4_RGBA4_OES:
+  case GL_PALETTE4_RGB5_A1_OES:
+  case GL_PALETTE8_RGB8_OES:
+  case GL_PALETTE8_RGBA8_OES:
+  case GL_PALETTE8_R5_G6_B5_OES:
+  case GL_PALETTE8_RGBA4_OES:
+  case GL_PALETTE8_RGB5_A1_OES:
+    upload_paletted_texture(tx, level, internalformat, width, height, imageSize, data);
+    return;
+  default:
+    unimplemented("%d", internalformat);
+    assert(false);
+    return;
+  }
+
+  if (level == 0) {
+    reset_texture_saved_size(tx);
+    set_texture_layout(tx, internal_base_format, GL_UNSIGNED_BYTE, gl_to_xgu_texture_format(internalformat), width, height, 0, block_size);
+    assert(!tx->linear);
+  } else if (!(tx->level_mask & 1) || (tx->format != gl_to_xgu_texture_format(internalformat))) {
+    // Like in upload_texture_level, levels need a matching level 0
+    debugPrint("Ignoring level %d which doesn't match level 0\n", level);
+    return;
+  }
+
+  // Calculate required size and location of mipmaps
+  size_t level_offset[TEXTURE_MAX_LEVELS];
+  unsigned int level_width[TEXTURE_MAX_LEVELS];
+  unsigned int level_height[TEXTURE_MAX_LEVELS];
+  size_t size;
+  unsigned int mip_levels = get_texture_levels(tx, level_offset, level_width, level_height, &size);
+  if ((level >= mip_levels) || (width != level_width[level]) || (height != level_height[level])) {
+    assert(level != 0);
+    debugPrint("Ignoring level %d which doesn't match level 0\n", level);
+    return;
+  }
+  size_t level_size = ((level + 1 < mip_levels) ? level_offset[level + 1] : size) - level_offset[level];
+  assert(imageSize == level_size);
+
+  // Level 0 only needs room for itself, unless other levels are kept
+  if (level == 0) {
+    if (!tx->explicit_mipmaps) {
+      size = level_size;
+    }
+    reserve_texture_storage(tx, size, tx->explicit_mipmaps ? tx->data_size : 0);
+  } else {
+    reserve_texture_storage(tx, size, tx->data_size);
+    tx->explicit_mipmaps = true;
+  }
+
+  // Blocks are used as-is, they are not swizzled
+  assert(data != NULL);
+  memcpy(&((uint8_t*)tx->data)[level_offset[level]], data, level_size);
+  tx->level_mask |= 1 << level;
+}
+
+GL_API void GL_APIENTRY glCompressedTexSubImage2D (GLenum target, GLint level, GLint xoffset, GLint yoffset, GLsizei width, GLsizei height, GLenum format, GLsizei imageSize, const void *data) {
+  assert(target == GL_TEXTURE_2D);
+
+  Texture* tx = get_bound_texture(active_texture);
+
+  size_t level_offset[TEXTURE_MAX_LEVELS];
+  unsigned int level_width[TEXTURE_MAX_LEVELS];
+  unsigned int level_height[TEXTURE_MAX_LEVELS];
+  size_t size;
+  unsigned int mip_levels = get_texture_levels(tx, level_offset, level_width, level_height, &size);
+
+  // Only entire blocks can be replaced
+  assert(tx->data != NULL);
+  assert(tx->compressed_block_size != 0);
+  assert(tx->format == gl_to_xgu_texture_format(format));
+  assert(level < mip_levels);
+  assert(tx->level_mask & (1 << level));
+  assert(xoffset >= 0);
+  assert(yoffset >= 0);
+  assert((xoffset % 4) == 0);
+  assert((yoffset % 4) == 0);
+  assert(((width % 4) == 0) || (xoffset + width == level_width[level]));
+  assert(((height % 4) == 0) || (yoffset + height == level_height[level]));
+  assert(xoffset + width <= level_width[level]);
+  assert(yoffset + height <= level_height[level]);
+
+  //FIXME: Texture cache might have to be invalidated
+  prepare_texture_update(tx, level, width, height);
+  dirty |= DIRTY_TEXTURES;
+
+  unsigned int block_size = tx->compressed_block_size;
+  unsigned int blocks_wide = (width + 3) / 4;
+  unsigned int blocks_high = (height + 3) / 4;
+  unsigned int level_blocks_wide = (level_width[level] + 3) / 4;
+  assert(imageSize == blocks_wide * blocks_high * block_size);
+
+  assert(data != NULL);
+  const uint8_t* src = data;
+  uint8_t* dst = &((uint8_t*)tx->data)[level_offset[level]];
+  dst += ((yoffset / 4) * level_blocks_wide + (xoffset / 4)) * block_size;
+  for(unsigned int y = 0; y < blocks_high; y++) {
+    memcpy(dst, src, blocks_wide * block_size);
+    src += blocks_wide * block_size;
+    dst += level_blocks_wide * block_size;
+  }
 }
 
 GL_API void GL_APIENTRY glTexParameteri (GLenum target, GLenum pname, GLint param) {
@@ -2458,7 +4679,7 @@ GL_API void GL_APIENTRY glTexParameteri (GLenum target, GLenum pname, GLint para
 
   switch(pname) {
   case GL_GENERATE_MIPMAP_SGIS:
-    unimplemented(); //FIXME: Make this optional (currently assumed true)
+    tx->generate_mipmap = (param != GL_FALSE);
     break;
   case GL_TEXTURE_MIN_FILTER:
     tx->min_filter = param;
@@ -2477,6 +4698,7 @@ GL_API void GL_APIENTRY glTexParameteri (GLenum target, GLenum pname, GLint para
     assert(false);
     return;
   }
+  dirty |= DIRTY_TEXTURES;
 }
 
 
@@ -2493,10 +4715,17 @@ GL_API void GL_APIENTRY glAlphaFunc (GLenum func, GLfloat ref) {
 }
 
 GL_API void GL_APIENTRY glBlendFunc (GLenum sfactor, GLenum dfactor) {
+  XguBlendFactor xgu_sfactor = gl_to_xgu_blend_factor(sfactor);
+  XguBlendFactor xgu_dfactor = gl_to_xgu_blend_factor(dfactor);
+
   uint32_t* p = pb_begin();
-  p = xgu_set_blend_func_sfactor(p, gl_to_xgu_blend_factor(sfactor));
-  p = xgu_set_blend_func_dfactor(p, gl_to_xgu_blend_factor(dfactor));
-  pb_end(p);
+  if (shadow_update(SHADOW_BLEND_FUNC_SFACTOR, xgu_sfactor)) {
+    p = xgu_set_blend_func_sfactor(p, xgu_sfactor);
+  }
+  if (shadow_update(SHADOW_BLEND_FUNC_DFACTOR, xgu_dfactor)) {
+    p = xgu_set_blend_func_dfactor(p, xgu_dfactor);
+  }
+  pb_commit(p);
 }
 
 GL_API void GL_APIENTRY glClipPlanef (GLenum p, const GLfloat *eqn) {
@@ -2515,6 +4744,7 @@ GL_API void GL_APIENTRY glClipPlanef (GLenum p, const GLfloat *eqn) {
   clip_plane->y = v[1];
   clip_plane->z = v[2];
   clip_plane->w = v[3];
+  dirty |= DIRTY_TEXTURES;
 }
 
 GL_API void GL_APIENTRY glColor4ub (GLubyte red, GLubyte green, GLubyte blue, GLubyte alpha) {
@@ -2524,6 +4754,7 @@ GL_API void GL_APIENTRY glColor4ub (GLubyte red, GLubyte green, GLubyte blue, GL
   state.color_array.value[1] = green / 255.0f;
   state.color_array.value[2] = blue / 255.0f;
   state.color_array.value[3] = alpha / 255.0f;
+  dirty |= DIRTY_ATTRIBS;
 }
 
 GL_API void GL_APIENTRY glColor4f (GLfloat red, GLfloat green, GLfloat blue, GLfloat alpha) {
@@ -2532,6 +4763,7 @@ GL_API void GL_APIENTRY glColor4f (GLfloat red, GLfloat green, GLfloat blue, GLf
   state.color_array.value[1] = green;
   state.color_array.value[2] = blue;
   state.color_array.value[3] = alpha;
+  dirty |= DIRTY_ATTRIBS;
 }
 
 GL_API void GL_APIENTRY glColorMask (GLboolean red, GLboolean green, GLboolean blue, GLboolean alpha) {
@@ -2543,32 +4775,40 @@ GL_API void GL_APIENTRY glColorMask (GLboolean red, GLboolean green, GLboolean b
   if (alpha != GL_FALSE) { mask |= XGU_ALPHA; }
 
   uint32_t* p = pb_begin();
-  p = xgu_set_color_mask(p, mask);
-  pb_end(p);
+  if (shadow_update(SHADOW_COLOR_MASK, mask)) {
+    p = xgu_set_color_mask(p, mask);
+  }
+  pb_commit(p);
 }
 
 GL_API void GL_APIENTRY glDepthFunc (GLenum func) {
+  XguFuncType xgu_func = gl_to_xgu_func_type(func);
+
   uint32_t* p = pb_begin();
-  p = xgu_set_depth_func(p, gl_to_xgu_func_type(func));
-  pb_end(p);
+  if (shadow_update(SHADOW_DEPTH_FUNC, xgu_func)) {
+    p = xgu_set_depth_func(p, xgu_func);
+  }
+  pb_commit(p);
 }
 
 GL_API void GL_APIENTRY glDepthMask (GLboolean flag) {
   uint32_t* p = pb_begin();
-  p = xgu_set_depth_mask(p, flag);
-  pb_end(p);  
+  if (shadow_update(SHADOW_DEPTH_MASK, flag)) {
+    p = xgu_set_depth_mask(p, flag);
+  }
+  pb_commit(p);  
 }
 
 GL_API void GL_APIENTRY glEnable (GLenum cap) {
   uint32_t* p = pb_begin();
   p = set_enabled(p, cap, true);
-  pb_end(p);
+  pb_commit(p);
 }
 
 GL_API void GL_APIENTRY glDisable (GLenum cap) {
   uint32_t* p = pb_begin();
   p = set_enabled(p, cap, false);
-  pb_end(p);
+  pb_commit(p);
 }
 
 GL_API void GL_APIENTRY glEnableClientState (GLenum array) {
@@ -2580,33 +4820,59 @@ GL_API void GL_APIENTRY glDisableClientState (GLenum array) {
 }
 
 GL_API void GL_APIENTRY glCullFace (GLenum mode) {
+  XguCullFace xgu_mode = gl_to_xgu_cull_face(mode);
+
   uint32_t* p = pb_begin();
-  p = xgu_set_cull_face(p, gl_to_xgu_cull_face(mode));
-  pb_end(p);
+  if (shadow_update(SHADOW_CULL_FACE, xgu_mode)) {
+    p = xgu_set_cull_face(p, xgu_mode);
+  }
+  pb_commit(p);
 }
 
 GL_API void GL_APIENTRY glFrontFace (GLenum mode) {
+  XguFrontFace xgu_mode = gl_to_xgu_front_face(mode);
+
   uint32_t* p = pb_begin();
-  p = xgu_set_front_face(p, gl_to_xgu_front_face(mode));
-  pb_end(p);
+  if (shadow_update(SHADOW_FRONT_FACE, xgu_mode)) {
+    p = xgu_set_front_face(p, xgu_mode);
+  }
+  pb_commit(p);
 }
 
 
 // Stencil actions
 GL_API void GL_APIENTRY glStencilFunc (GLenum func, GLint ref, GLuint mask) {
+  XguFuncType xgu_func = gl_to_xgu_func_type(func);
+
   uint32_t* p = pb_begin();
-  p = xgu_set_stencil_func(p, gl_to_xgu_func_type(func));
-  p = xgu_set_stencil_func_ref(p, ref);
-  p = xgu_set_stencil_func_mask(p, mask);
-  pb_end(p);
+  if (shadow_update(SHADOW_STENCIL_FUNC, xgu_func)) {
+    p = xgu_set_stencil_func(p, xgu_func);
+  }
+  if (shadow_update(SHADOW_STENCIL_FUNC_REF, ref)) {
+    p = xgu_set_stencil_func_ref(p, ref);
+  }
+  if (shadow_update(SHADOW_STENCIL_FUNC_MASK, mask)) {
+    p = xgu_set_stencil_func_mask(p, mask);
+  }
+  pb_commit(p);
 }
 
 GL_API void GL_APIENTRY glStencilOp (GLenum fail, GLenum zfail, GLenum zpass) {
+  XguStencilOp xgu_fail = gl_to_xgu_stencil_op(fail);
+  XguStencilOp xgu_zfail = gl_to_xgu_stencil_op(zfail);
+  XguStencilOp xgu_zpass = gl_to_xgu_stencil_op(zpass);
+
   uint32_t* p = pb_begin();
-  p = xgu_set_stencil_op_fail(p, gl_to_xgu_stencil_op(fail));
-  p = xgu_set_stencil_op_zfail(p, gl_to_xgu_stencil_op(zfail));
-  p = xgu_set_stencil_op_zpass(p, gl_to_xgu_stencil_op(zpass));
-  pb_end(p);
+  if (shadow_update(SHADOW_STENCIL_OP_FAIL, xgu_fail)) {
+    p = xgu_set_stencil_op_fail(p, xgu_fail);
+  }
+  if (shadow_update(SHADOW_STENCIL_OP_ZFAIL, xgu_zfail)) {
+    p = xgu_set_stencil_op_zfail(p, xgu_zfail);
+  }
+  if (shadow_update(SHADOW_STENCIL_OP_ZPASS, xgu_zpass)) {
+    p = xgu_set_stencil_op_zpass(p, xgu_zpass);
+  }
+  pb_commit(p);
 }
 
 
@@ -2692,6 +4958,7 @@ GL_API void GL_APIENTRY glTexEnvi (GLenum target, GLenum pname, GLint param) {
     assert(false);
     return;
   }
+  dirty |= DIRTY_TEXENV;
 }
 
 
@@ -2705,12 +4972,13 @@ GL_API void GL_APIENTRY glReadPixels (GLint x, GLint y, GLsizei width, GLsizei h
 // Lighting
 GL_API void GL_APIENTRY glLightModelf (GLenum pname, GLfloat param) {
   switch(pname) {
-  case GL_LIGHT_MODEL_TWO_SIDE:
+  case GL_LIGHT_MODEL_TWO_SIDE: {
     //FIXME: Why is this never called by neverball?
     uint32_t* p = pb_begin();
     p = xgu_set_two_side_light_enable(p, (bool)param);
-    pb_end(p);
+    pb_commit(p);
     break;
+  }
   case GL_LIGHT_MODEL_LOCAL_VIEWER:
     unimplemented(); //FIXME: Not provided by XGU yet
     //uint32_t* p = pb_begin();
@@ -2737,6 +5005,7 @@ GL_API void GL_APIENTRY glLightModelfv (GLenum pname, const GLfloat *params) {
     assert(false);
     return;
   }
+  dirty |= DIRTY_LIGHTING;
 }
 
 GL_API void GL_APIENTRY glLightfv (GLenum light, GLenum pname, const GLfloat *params) {
@@ -2802,6 +5071,7 @@ GL_API void GL_APIENTRY glLightfv (GLenum light, GLenum pname, const GLfloat *pa
     assert(false);
     return;
   }
+  dirty |= DIRTY_LIGHTING;
 }
 
 
@@ -2828,6 +5098,7 @@ GL_API void GL_APIENTRY glColorMaterial (GLenum face, GLenum mode) {
     assert(false);
     return;
   }
+  dirty |= DIRTY_LIGHTING;
 }
 
 GL_API void GL_APIENTRY glMaterialfv (GLenum face, GLenum pname, const GLfloat *params) {
@@ -2879,6 +5150,21 @@ GL_API void GL_APIENTRY glMaterialfv (GLenum face, GLenum pname, const GLfloat *
     assert(false);
     return;
   }
+  dirty |= DIRTY_LIGHTING;
+}
+
+
+// Hints
+GL_API void GL_APIENTRY glHint (GLenum target, GLenum mode) {
+  switch(target) {
+  case GL_TEXTURE_DOWNCONVERT_HINT:
+    // Only affects textures which are uploaded afterwards
+    texture_downconvert_hint = mode;
+    break;
+  default:
+    unimplemented("%d", target);
+    break;
+  }
 }
 
 
@@ -2951,26 +5237,58 @@ EGLAPI EGLBoolean EGLAPIENTRY eglSwapBuffers (EGLDisplay dpy, EGLSurface surface
   mem_stats.Length = sizeof(mem_stats);
   MmQueryStatistics(&mem_stats);
   ULONGLONG duration_frequency = KeQueryPerformanceFrequency();
-  pb_print("Frame: %u; memory: %uMiB / %uMiB; drawcalls: %u; pb: %ukiB; cpu: %ums; gpu: %ums\n",
+
+  // Measure how much we recorded and how long it took, excluding stalls
+  Fence frame_end = pb_fence();
+  ULONGLONG frame_end_time = KeQueryPerformanceCounter();
+  p_size = (frame_end - frame_start) * 4;
+  cpu_duration = (frame_end_time - frame_start_time) - stall_duration;
+
+  size_t region_size;
+  size_t region_free_size;
+  size_t region_largest_free_size;
+  get_resource_memory_stats(&region_size, &region_free_size, &region_largest_free_size);
+  unsigned int fragmentation = 0;
+  if (region_free_size > 0) {
+    fragmentation = 100 - (region_largest_free_size * 100) / region_free_size;
+  }
+
+  pb_print("Frame: %u; memory: %uMiB / %uMiB (textures saved %ukiB; regions %ukiB free of %uMiB, %u%% fragmented); drawcalls: %u; pb: %ukiB; stream: %ukiB; filtered: %u; cpu: %ums; stall: %ums\n",
            frame,
            ((mem_stats.TotalPhysicalPages - mem_stats.AvailablePages) * 4) / 1024,
            (mem_stats.TotalPhysicalPages * 4) / 1024,
+           (unsigned int)(texture_saved_size / 1024),
+           (unsigned int)(region_free_size / 1024),
+           (unsigned int)(region_size / (1024 * 1024)),
+           fragmentation,
            drawcall_count,
            p_size / 1024,
+           (unsigned int)(stream_size / 1024),
+           filtered_method_count,
            (unsigned int)((cpu_duration * 1000ULL) / duration_frequency),
-           (unsigned int)((gpu_duration * 1000ULL) / duration_frequency));
+           (unsigned int)((stall_duration * 1000ULL) / duration_frequency));
   pb_draw_text_screen();
   drawcall_count = 0;
-  p_size = 0;
-  cpu_duration = 0;
-  gpu_duration = 0;
+  stream_size = 0;
+  filtered_method_count = 0;
+  stall_duration = 0;
+  frame_start = frame_end;
+  frame_start_time = frame_end_time;
 
-  // Wait for GPU and go to start of pushbuffer
-  reset_pb();
+  // Wait for GPU
+  retire_stream_memory();
+  pb_sync();
+  collect_retired_resources();
 
   // Swap buffers
   while(pb_finished());
 
+  // Close gaps in resource memory while nothing is using it
+  ULONGLONG defragment_budget = (duration_frequency * RESOURCE_DEFRAGMENT_BUDGET_US) / 1000000ULL;
+  if (defragment_resource_memory(defragment_budget)) {
+    dirty |= DIRTY_ATTRIBS | DIRTY_TEXTURES;
+  }
+
   // Prepare next frame
   //pb_wait_for_vbl();
   pb_target_back_buffer();
@@ -2992,6 +5310,8 @@ EGLAPI EGLBoolean EGLAPIENTRY eglSwapBuffers (EGLDisplay dpy, EGLSurface surface
 
 __attribute__((constructor(0xFFFFFFFF))) static void gl_init(void) {
 
+  pb_ring_init();
+
   //FIXME: Bump GPU in right state?
   uint32_t* p = pb_begin();
   uint32_t control0 = 0;
@@ -3036,7 +5356,7 @@ __attribute__((constructor(0xFFFFFFFF))) static void gl_init(void) {
   p = xgu_set_clip_min(p, (float)0x000000);
   p = xgu_set_clip_max(p, (float)0xFFFFFF);
   p = pb_push1(p,NV097_SET_COMPRESS_ZBUFFER_EN,1); //FIXME: Does this work?
-  pb_end(p);
+  pb_commit(p);
 
 
   // Set up some defaults
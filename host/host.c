@@ -0,0 +1,371 @@
+// Host (Linux) backend for xgu-gl
+//
+// The pushbuffer is a block of "contiguous" memory like on the Xbox, but
+// nothing consumes it; instead, pb_end() copies each committed range into a
+// growable recording. Contiguous memory is carved out of a single heap arena
+// which is aligned to its own size, so `address & 0x03ffffff` still yields a
+// stable offset which can be compared between runs.
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include <hal/debug.h>
+#include <hal/video.h>
+#include <pbkit/pbkit.h>
+#include <xboxkrnl/xboxkrnl.h>
+#include <windows.h>
+#include <SDL.h>
+
+#include "host.h"
+
+#define RAM_SIZE 0x04000000
+#define RAM_PAGE_COUNT (RAM_SIZE / PAGE_SIZE)
+
+#define PB_SIZE (512 * 1024)
+
+static uint8_t* ram = NULL;
+static uint32_t ram_page_run[RAM_PAGE_COUNT]; // Pages in allocation starting at this page, or 0
+static bool ram_page_used[RAM_PAGE_COUNT];
+static size_t ram_used = 0;
+
+static uint32_t* pb_head = NULL;
+static uint32_t* pb_tail = NULL;
+static uint32_t* pb_put = NULL;
+static bool pb_in_begin = false;
+
+static uint32_t* recording = NULL;
+static size_t recording_count = 0;
+static size_t recording_capacity = 0;
+
+static void init_ram(void) {
+  if (ram != NULL) {
+    return;
+  }
+
+  // Aligning to the size makes the low bits of each pointer its "physical" address
+  ram = aligned_alloc(RAM_SIZE, RAM_SIZE);
+  assert(ram != NULL);
+
+  // Never hand out physical address 0
+  ram_page_used[0] = true;
+  ram_page_run[0] = 1;
+}
+
+static void init_pb(void) {
+  if (pb_head != NULL) {
+    return;
+  }
+  pb_head = MmAllocateContiguousMemoryEx(PB_SIZE, 0, RAM_SIZE - 1, 0, PAGE_READWRITE | PAGE_WRITECOMBINE);
+  pb_tail = &pb_head[PB_SIZE / 4];
+  pb_put = pb_head;
+}
+
+static void record(const uint32_t* words, size_t count) {
+  if (recording_count + count > recording_capacity) {
+    size_t capacity = recording_capacity ? recording_capacity : 0x10000;
+    while(capacity < recording_count + count) {
+      capacity *= 2;
+    }
+    recording = realloc(recording, capacity * sizeof(uint32_t));
+    assert(recording != NULL);
+    recording_capacity = capacity;
+  }
+  memcpy(&recording[recording_count], words, count * sizeof(uint32_t));
+  recording_count += count;
+}
+
+const uint32_t* host_pb_recording(size_t* word_count) {
+  *word_count = recording_count;
+  return recording;
+}
+
+void host_pb_clear_recording(void) {
+  recording_count = 0;
+}
+
+size_t host_contiguous_memory_used(void) {
+  return ram_used;
+}
+
+
+// hal/debug.h
+
+void debugPrint(const char* format, ...) {
+  va_list va;
+  va_start(va, format);
+  vfprintf(stderr, format, va);
+  va_end(va);
+}
+
+
+// hal/video.h
+
+#define NV_USER_DMA_GET 0x00800044
+
+volatile uint32_t* host_videoreg(uint32_t offset) {
+  static uint32_t dma_get;
+  static uint32_t dummy;
+
+  // The GPU has always fetched everything up to the last pb_end()
+  if (offset == NV_USER_DMA_GET) {
+    init_pb();
+    dma_get = MmGetPhysicalAddress(pb_put);
+    return &dma_get;
+  }
+
+  dummy = 0;
+  return &dummy;
+}
+
+
+// xboxkrnl/xboxkrnl.h
+
+PVOID MmAllocateContiguousMemoryEx(SIZE_T NumberOfBytes, ULONG_PTR LowestAcceptableAddress, ULONG_PTR HighestAcceptableAddress, ULONG_PTR Alignment, ULONG Protect) {
+  init_ram();
+
+  size_t pages = (NumberOfBytes + PAGE_SIZE - 1) / PAGE_SIZE;
+  size_t alignment = (Alignment > PAGE_SIZE) ? (Alignment / PAGE_SIZE) : 1;
+  size_t first = (LowestAcceptableAddress + PAGE_SIZE - 1) / PAGE_SIZE;
+  size_t last = HighestAcceptableAddress / PAGE_SIZE;
+  if (last >= RAM_PAGE_COUNT) {
+    last = RAM_PAGE_COUNT - 1;
+  }
+  if (pages == 0) {
+    pages = 1;
+  }
+
+  // First-fit, so the same sequence of calls always yields the same addresses
+  first = (first + alignment - 1) / alignment * alignment;
+  for(size_t start = first; start + pages - 1 <= last; start += alignment) {
+    size_t i;
+    for(i = 0; i < pages; i++) {
+      if (ram_page_used[start + i]) {
+        break;
+      }
+    }
+    if (i < pages) {
+      continue;
+    }
+
+    for(i = 0; i < pages; i++) {
+      ram_page_used[start + i] = true;
+    }
+    ram_page_run[start] = pages;
+    ram_used += pages * PAGE_SIZE;
+    return &ram[start * PAGE_SIZE];
+  }
+
+  return NULL;
+}
+
+VOID MmFreeContiguousMemory(PVOID BaseAddress) {
+  size_t offset = (uint8_t*)BaseAddress - ram;
+  assert(offset < RAM_SIZE);
+  assert((offset % PAGE_SIZE) == 0);
+
+  size_t start = offset / PAGE_SIZE;
+  size_t pages = ram_page_run[start];
+  assert(pages > 0);
+  for(size_t i = 0; i < pages; i++) {
+    ram_page_used[start + i] = false;
+  }
+  ram_page_run[start] = 0;
+  ram_used -= pages * PAGE_SIZE;
+}
+
+ULONG_PTR MmGetPhysicalAddress(PVOID BaseAddress) {
+  return (uintptr_t)BaseAddress & (RAM_SIZE - 1);
+}
+
+SIZE_T MmQueryAllocationSize(PVOID BaseAddress) {
+  size_t offset = (uint8_t*)BaseAddress - ram;
+  assert(offset < RAM_SIZE);
+  return ram_page_run[offset / PAGE_SIZE] * PAGE_SIZE;
+}
+
+int MmQueryStatistics(PMM_STATISTICS MemoryStatistics) {
+  init_ram();
+  MemoryStatistics->TotalPhysicalPages = RAM_PAGE_COUNT;
+  MemoryStatistics->AvailablePages = RAM_PAGE_COUNT - ram_used / PAGE_SIZE;
+  return 0;
+}
+
+ULONGLONG KeQueryPerformanceCounter(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ULONGLONG)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+ULONGLONG KeQueryPerformanceFrequency(void) {
+  return 1000000000ULL;
+}
+
+
+// windows.h
+
+void Sleep(DWORD milliseconds) {
+  struct timespec ts = {
+    .tv_sec = milliseconds / 1000,
+    .tv_nsec = (milliseconds % 1000) * 1000000L
+  };
+  nanosleep(&ts, NULL);
+}
+
+
+// pbkit/pbkit.h
+
+uint32_t* pb_begin(void) {
+  init_pb();
+  assert(!pb_in_begin);
+  pb_in_begin = true;
+  return pb_put;
+}
+
+void pb_end(uint32_t* pEnd) {
+  assert(pb_in_begin);
+  assert(pEnd >= pb_put);
+  assert(pEnd <= pb_tail);
+  record(pb_put, pEnd - pb_put);
+  pb_put = pEnd;
+  pb_in_begin = false;
+}
+
+void pb_reset(void) {
+  init_pb();
+  assert(!pb_in_begin);
+  pb_put = pb_head;
+}
+
+// Commands are considered consumed as soon as they are committed
+int pb_busy(void) {
+  return 0;
+}
+
+int pb_finished(void) {
+  return 0;
+}
+
+void pb_push_to(DWORD subchannel, uint32_t* p, DWORD command, DWORD nparam) {
+  *p = EncodeMethod(subchannel, command, nparam);
+}
+
+void pb_push(uint32_t* p, DWORD command, DWORD nparam) {
+  pb_push_to(SUBCH_3D, p, command, nparam);
+}
+
+uint32_t* pb_push1_to(DWORD subchannel, uint32_t* p, DWORD command, DWORD param1) {
+  pb_push_to(subchannel, p, command, 1);
+  p[1] = param1;
+  return p + 2;
+}
+
+uint32_t* pb_push1(uint32_t* p, DWORD command, DWORD param1) {
+  return pb_push1_to(SUBCH_3D, p, command, param1);
+}
+
+uint32_t* pb_push2_to(DWORD subchannel, uint32_t* p, DWORD command, DWORD param1, DWORD param2) {
+  pb_push_to(subchannel, p, command, 2);
+  p[1] = param1;
+  p[2] = param2;
+  return p + 3;
+}
+
+uint32_t* pb_push2(uint32_t* p, DWORD command, DWORD param1, DWORD param2) {
+  return pb_push2_to(SUBCH_3D, p, command, param1, param2);
+}
+
+uint32_t* pb_push3_to(DWORD subchannel, uint32_t* p, DWORD command, DWORD param1, DWORD param2, DWORD param3) {
+  pb_push_to(subchannel, p, command, 3);
+  p[1] = param1;
+  p[2] = param2;
+  p[3] = param3;
+  return p + 4;
+}
+
+uint32_t* pb_push3(uint32_t* p, DWORD command, DWORD param1, DWORD param2, DWORD param3) {
+  return pb_push3_to(SUBCH_3D, p, command, param1, param2, param3);
+}
+
+uint32_t* pb_push4_to(DWORD subchannel, uint32_t* p, DWORD command, DWORD param1, DWORD param2, DWORD param3, DWORD param4) {
+  pb_push_to(subchannel, p, command, 4);
+  p[1] = param1;
+  p[2] = param2;
+  p[3] = param3;
+  p[4] = param4;
+  return p + 5;
+}
+
+uint32_t* pb_push4(uint32_t* p, DWORD command, DWORD param1, DWORD param2, DWORD param3, DWORD param4) {
+  return pb_push4_to(SUBCH_3D, p, command, param1, param2, param3, param4);
+}
+
+uint32_t* pb_push4f(uint32_t* p, DWORD command, float param1, float param2, float param3, float param4) {
+  pb_push_to(SUBCH_3D, p, command, 4);
+  memcpy(&p[1], &param1, 4);
+  memcpy(&p[2], &param2, 4);
+  memcpy(&p[3], &param3, 4);
+  memcpy(&p[4], &param4, 4);
+  return p + 5;
+}
+
+uint32_t* pb_push_transposed_matrix(uint32_t* p, DWORD command, const float* m) {
+  pb_push_to(SUBCH_3D, p++, command, 16);
+  for(int i = 0; i < 4; i++) {
+    for(int j = 0; j < 4; j++) {
+      memcpy(p++, &m[j * 4 + i], 4);
+    }
+  }
+  return p;
+}
+
+void pb_print(const char* format, ...) {
+  va_list va;
+  va_start(va, format);
+  vprintf(format, va);
+  va_end(va);
+}
+
+void pb_erase_text_screen(void) {}
+void pb_draw_text_screen(void) {}
+void pb_show_front_screen(void) {}
+void pb_show_debug_screen(void) {}
+void pb_target_back_buffer(void) {}
+
+int pb_wait_for_vbl(void) {
+  return 0;
+}
+
+DWORD pb_back_buffer_width(void) {
+  return 640;
+}
+
+DWORD pb_back_buffer_height(void) {
+  return 480;
+}
+
+void pb_set_viewport(int dwx, int dwy, int width, int height, float zmin, float zmax) {}
+
+
+// SDL.h
+
+struct _SDL_GameController {
+  int index;
+};
+
+// Never fail, otherwise eglSwapBuffers will back off for 100ms every frame
+SDL_GameController* SDL_GameControllerOpen(int joystick_index) {
+  static SDL_GameController controller;
+  controller.index = joystick_index;
+  return &controller;
+}
+
+void SDL_GameControllerUpdate(void) {}
+
+uint8_t SDL_GameControllerGetButton(SDL_GameController* gamecontroller, SDL_GameControllerButton button) {
+  return 0;
+}
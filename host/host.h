@@ -0,0 +1,22 @@
+// Host (Linux) backend for xgu-gl
+//
+// Stands in for pbkit, the kernel and SDL, so gl.c can run without hardware.
+// Every pushbuffer word which is committed with pb_end() is appended to an
+// in-memory recording, which can be inspected to check the exact method
+// stream or to measure how much work a GL call generates.
+
+#ifndef XGU_GL_HOST_H
+#define XGU_GL_HOST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Returns all words recorded since startup or the last call to
+// `host_pb_clear_recording`; the pointer is valid until the next pb_end()
+const uint32_t* host_pb_recording(size_t* word_count);
+void host_pb_clear_recording(void);
+
+// Number of bytes currently handed out by MmAllocateContiguousMemoryEx
+size_t host_contiguous_memory_used(void);
+
+#endif
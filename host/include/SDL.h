@@ -0,0 +1,33 @@
+// Host stand-in for <SDL.h>
+// The game controller is only used for debug toggles, so it never reports input.
+
+#ifndef XGU_GL_HOST_SDL_H
+#define XGU_GL_HOST_SDL_H
+
+#include <stdint.h>
+
+typedef struct _SDL_GameController SDL_GameController;
+
+typedef enum {
+  SDL_CONTROLLER_BUTTON_A,
+  SDL_CONTROLLER_BUTTON_B,
+  SDL_CONTROLLER_BUTTON_X,
+  SDL_CONTROLLER_BUTTON_Y,
+  SDL_CONTROLLER_BUTTON_BACK,
+  SDL_CONTROLLER_BUTTON_GUIDE,
+  SDL_CONTROLLER_BUTTON_START,
+  SDL_CONTROLLER_BUTTON_LEFTSTICK,
+  SDL_CONTROLLER_BUTTON_RIGHTSTICK,
+  SDL_CONTROLLER_BUTTON_LEFTSHOULDER,
+  SDL_CONTROLLER_BUTTON_RIGHTSHOULDER,
+  SDL_CONTROLLER_BUTTON_DPAD_UP,
+  SDL_CONTROLLER_BUTTON_DPAD_DOWN,
+  SDL_CONTROLLER_BUTTON_DPAD_LEFT,
+  SDL_CONTROLLER_BUTTON_DPAD_RIGHT
+} SDL_GameControllerButton;
+
+SDL_GameController* SDL_GameControllerOpen(int joystick_index);
+void SDL_GameControllerUpdate(void);
+uint8_t SDL_GameControllerGetButton(SDL_GameController* gamecontroller, SDL_GameControllerButton button);
+
+#endif
@@ -0,0 +1,8 @@
+// Host stand-in for <hal/debug.h>
+
+#ifndef XGU_GL_HOST_HAL_DEBUG_H
+#define XGU_GL_HOST_HAL_DEBUG_H
+
+void debugPrint(const char* format, ...);
+
+#endif
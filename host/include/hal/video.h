@@ -0,0 +1,13 @@
+// Host stand-in for <hal/video.h>
+// GPU registers are emulated by the host backend.
+
+#ifndef XGU_GL_HOST_HAL_VIDEO_H
+#define XGU_GL_HOST_HAL_VIDEO_H
+
+#include <stdint.h>
+
+volatile uint32_t* host_videoreg(uint32_t offset);
+
+#define VIDEOREG(x) (*host_videoreg(x))
+
+#endif
@@ -0,0 +1,8 @@
+// Host stand-in for <hal/xbox.h>
+
+#ifndef XGU_GL_HOST_HAL_XBOX_H
+#define XGU_GL_HOST_HAL_XBOX_H
+
+#include <xboxkrnl/xboxkrnl.h>
+
+#endif
@@ -0,0 +1,51 @@
+// Host stand-in for <pbkit/pbkit.h>
+// Method definitions still come from the nxdk <pbkit/nv_regs.h>.
+
+#ifndef XGU_GL_HOST_PBKIT_H
+#define XGU_GL_HOST_PBKIT_H
+
+#include <stdint.h>
+
+#include <xboxkrnl/xboxkrnl.h>
+
+#include <pbkit/nv_regs.h>
+
+#define SUBCH_3D 0
+#define SUBCH_2 2
+#define SUBCH_3 3
+#define SUBCH_4 4
+
+#define EncodeMethod(subchannel, command, nparam) (((nparam) << 18) + ((subchannel) << 13) + (command))
+
+uint32_t* pb_begin(void);
+void pb_end(uint32_t* pEnd);
+void pb_reset(void);
+int pb_busy(void);
+int pb_finished(void);
+
+void pb_push_to(DWORD subchannel, uint32_t* p, DWORD command, DWORD nparam);
+void pb_push(uint32_t* p, DWORD command, DWORD nparam);
+uint32_t* pb_push1_to(DWORD subchannel, uint32_t* p, DWORD command, DWORD param1);
+uint32_t* pb_push1(uint32_t* p, DWORD command, DWORD param1);
+uint32_t* pb_push2_to(DWORD subchannel, uint32_t* p, DWORD command, DWORD param1, DWORD param2);
+uint32_t* pb_push2(uint32_t* p, DWORD command, DWORD param1, DWORD param2);
+uint32_t* pb_push3_to(DWORD subchannel, uint32_t* p, DWORD command, DWORD param1, DWORD param2, DWORD param3);
+uint32_t* pb_push3(uint32_t* p, DWORD command, DWORD param1, DWORD param2, DWORD param3);
+uint32_t* pb_push4_to(DWORD subchannel, uint32_t* p, DWORD command, DWORD param1, DWORD param2, DWORD param3, DWORD param4);
+uint32_t* pb_push4(uint32_t* p, DWORD command, DWORD param1, DWORD param2, DWORD param3, DWORD param4);
+uint32_t* pb_push4f(uint32_t* p, DWORD command, float param1, float param2, float param3, float param4);
+uint32_t* pb_push_transposed_matrix(uint32_t* p, DWORD command, const float* m);
+
+void pb_print(const char* format, ...);
+void pb_erase_text_screen(void);
+void pb_draw_text_screen(void);
+
+void pb_show_front_screen(void);
+void pb_show_debug_screen(void);
+void pb_target_back_buffer(void);
+int pb_wait_for_vbl(void);
+DWORD pb_back_buffer_width(void);
+DWORD pb_back_buffer_height(void);
+void pb_set_viewport(int dwx, int dwy, int width, int height, float zmin, float zmax);
+
+#endif
@@ -0,0 +1,12 @@
+// Host stand-in for the nxdk <windows.h>
+
+#ifndef XGU_GL_HOST_WINDOWS_H
+#define XGU_GL_HOST_WINDOWS_H
+
+#include <stdlib.h>
+
+#include <xboxkrnl/xboxkrnl.h>
+
+void Sleep(DWORD milliseconds);
+
+#endif
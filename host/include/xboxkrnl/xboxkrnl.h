@@ -0,0 +1,45 @@
+// Host stand-in for <xboxkrnl/xboxkrnl.h>
+// Only the kernel calls which are used by xgu-gl are provided.
+
+#ifndef XGU_GL_HOST_XBOXKRNL_H
+#define XGU_GL_HOST_XBOXKRNL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef void VOID;
+typedef void* PVOID;
+typedef uint32_t DWORD;
+typedef uint32_t ULONG;
+typedef size_t SIZE_T;
+typedef uintptr_t ULONG_PTR;
+typedef uint64_t ULONGLONG;
+
+#define PAGE_READWRITE    0x04
+#define PAGE_NOCACHE      0x200
+#define PAGE_WRITECOMBINE 0x400
+
+#define PAGE_SIZE 0x1000
+
+typedef struct {
+  ULONG Length;
+  ULONG TotalPhysicalPages;
+  ULONG AvailablePages;
+  ULONG VirtualMemoryBytesCommitted;
+  ULONG VirtualMemoryBytesReserved;
+  ULONG CachePagesCommitted;
+  ULONG PoolPagesCommitted;
+  ULONG StackPagesCommitted;
+  ULONG ImagePagesCommitted;
+} MM_STATISTICS, *PMM_STATISTICS;
+
+PVOID MmAllocateContiguousMemoryEx(SIZE_T NumberOfBytes, ULONG_PTR LowestAcceptableAddress, ULONG_PTR HighestAcceptableAddress, ULONG_PTR Alignment, ULONG Protect);
+VOID MmFreeContiguousMemory(PVOID BaseAddress);
+ULONG_PTR MmGetPhysicalAddress(PVOID BaseAddress);
+SIZE_T MmQueryAllocationSize(PVOID BaseAddress);
+int MmQueryStatistics(PMM_STATISTICS MemoryStatistics);
+
+ULONGLONG KeQueryPerformanceCounter(void);
+ULONGLONG KeQueryPerformanceFrequency(void);
+
+#endif
@@ -23,6 +23,10 @@
 #include <string.h>
 #include <assert.h>
 
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
 #include "swizzle.h"
 
 /* This should be pretty straightforward.
@@ -72,17 +76,196 @@ static uint32_t fill_pattern(uint32_t pattern, uint32_t value)
     return result;
 }
 
-static unsigned int get_swizzled_offset(
-    unsigned int x, unsigned int y, unsigned int z,
-    uint32_t mask_x, uint32_t mask_y, uint32_t mask_z,
+/* Instead of scattering the bits of each coordinate into its mask, the
+ * swizzled coordinates are stepped directly: `(s - mask) & mask` sets all
+ * bits outside of the mask, so the carry of the +1 skips over them and
+ * yields the next value within the pattern.
+ */
+static inline uint32_t swizzle_step(uint32_t swizzled, uint32_t mask)
+{
+    return (swizzled - mask) & mask;
+}
+
+/* Copies a 4x4 block of texels between 4 rows of a linear image and the 16
+ * consecutive texels it occupies in a swizzled 2D image. The 2x2 quads of
+ * the block are stored in the order top-left, top-right, bottom-left,
+ * bottom-right; the texels of each quad in the same order.
+ * The 1 and 2 bytes per pixel variants shuffle texels within 32-bit words,
+ * which is symmetric, so they are used for both directions.
+ */
+static inline void swizzle_tile_8(const uint8_t *src, unsigned int src_pitch,
+                                  uint8_t *dst, unsigned int dst_pitch)
+{
+    uint32_t r[4], t[4];
+    int i;
+    for (i = 0; i < 4; i++) {
+        memcpy(&r[i], src + i * src_pitch, 4);
+    }
+    t[0] = (r[0] & 0xFFFF) | (r[1] << 16);
+    t[1] = (r[0] >> 16) | (r[1] & 0xFFFF0000);
+    t[2] = (r[2] & 0xFFFF) | (r[3] << 16);
+    t[3] = (r[2] >> 16) | (r[3] & 0xFFFF0000);
+    for (i = 0; i < 4; i++) {
+        memcpy(dst + i * dst_pitch, &t[i], 4);
+    }
+}
+
+static inline void swizzle_tile_16(const uint8_t *src, unsigned int src_pitch,
+                                   uint8_t *dst, unsigned int dst_pitch)
+{
+    uint32_t r[8], t[8];
+    int i;
+    for (i = 0; i < 4; i++) {
+        memcpy(&r[i * 2], src + i * src_pitch, 8);
+    }
+    t[0] = r[0]; t[1] = r[2]; t[2] = r[1]; t[3] = r[3];
+    t[4] = r[4]; t[5] = r[6]; t[6] = r[5]; t[7] = r[7];
+    for (i = 0; i < 4; i++) {
+        memcpy(dst + i * dst_pitch, &t[i * 2], 8);
+    }
+}
+
+static inline void swizzle_tile_32(const uint8_t *src, unsigned int row_pitch,
+                                   uint8_t *dst)
+{
+#ifdef __SSE__
+    /* Texels are only moved, so using float registers is bit-exact */
+    __m128 r0 = _mm_loadu_ps((const float *)(src + 0 * row_pitch));
+    __m128 r1 = _mm_loadu_ps((const float *)(src + 1 * row_pitch));
+    __m128 r2 = _mm_loadu_ps((const float *)(src + 2 * row_pitch));
+    __m128 r3 = _mm_loadu_ps((const float *)(src + 3 * row_pitch));
+    _mm_storeu_ps((float *)(dst + 0), _mm_movelh_ps(r0, r1));
+    _mm_storeu_ps((float *)(dst + 16), _mm_movehl_ps(r1, r0));
+    _mm_storeu_ps((float *)(dst + 32), _mm_movelh_ps(r2, r3));
+    _mm_storeu_ps((float *)(dst + 48), _mm_movehl_ps(r3, r2));
+#else
+    int i;
+    for (i = 0; i < 4; i += 2) {
+        const uint8_t *r0 = src + i * row_pitch;
+        const uint8_t *r1 = r0 + row_pitch;
+        memcpy(dst + 0, r0 + 0, 8);
+        memcpy(dst + 8, r1 + 0, 8);
+        memcpy(dst + 16, r0 + 8, 8);
+        memcpy(dst + 24, r1 + 8, 8);
+        dst += 32;
+    }
+#endif
+}
+
+static inline void unswizzle_tile_32(const uint8_t *src,
+                                     uint8_t *dst, unsigned int row_pitch)
+{
+#ifdef __SSE__
+    __m128 t0 = _mm_loadu_ps((const float *)(src + 0));
+    __m128 t1 = _mm_loadu_ps((const float *)(src + 16));
+    __m128 t2 = _mm_loadu_ps((const float *)(src + 32));
+    __m128 t3 = _mm_loadu_ps((const float *)(src + 48));
+    _mm_storeu_ps((float *)(dst + 0 * row_pitch), _mm_movelh_ps(t0, t1));
+    _mm_storeu_ps((float *)(dst + 1 * row_pitch), _mm_movehl_ps(t1, t0));
+    _mm_storeu_ps((float *)(dst + 2 * row_pitch), _mm_movelh_ps(t2, t3));
+    _mm_storeu_ps((float *)(dst + 3 * row_pitch), _mm_movehl_ps(t3, t2));
+#else
+    int i;
+    for (i = 0; i < 4; i += 2) {
+        uint8_t *r0 = dst + i * row_pitch;
+        uint8_t *r1 = r0 + row_pitch;
+        memcpy(r0 + 0, src + 0, 8);
+        memcpy(r1 + 0, src + 8, 8);
+        memcpy(r0 + 8, src + 16, 8);
+        memcpy(r1 + 8, src + 24, 8);
+        src += 32;
+    }
+#endif
+}
+
+/* The lowest 4 bits of the swizzle pattern are xyxy if the image is at least
+ * 4x4 and has no depth, so it can be processed in 4x4 blocks.
+ */
+static bool is_tileable(unsigned int width, unsigned int height,
+                        unsigned int depth)
+{
+    return (depth == 1) && (width >= 4) && (height >= 4)
+        && ((width % 4) == 0) && ((height % 4) == 0);
+}
+
+/* Removes the 2 lowest bits from a mask, so stepping it advances by 4 */
+static uint32_t tile_mask(uint32_t mask)
+{
+    mask &= mask - 1;
+    mask &= mask - 1;
+    return mask;
+}
+
+/* Always inlined, so each call with a constant `bytes_per_pixel` turns into a
+ * kernel with fixed size moves
+ */
+static inline __attribute__((always_inline)) void swizzle_tiles(
+    const uint8_t *src_buf,
+    unsigned int width,
+    unsigned int height,
+    uint8_t *dst_buf,
+    unsigned int row_pitch,
+    uint32_t mask_x,
+    uint32_t mask_y,
+    unsigned int bytes_per_pixel)
+{
+    uint32_t tile_mask_x = tile_mask(mask_x);
+    uint32_t tile_mask_y = tile_mask(mask_y);
+
+    int x, y;
+    uint32_t y_offset = 0;
+    for (y = 0; y < height; y += 4) {
+        const uint8_t *src = src_buf + y * row_pitch;
+        uint32_t x_offset = 0;
+        for (x = 0; x < width; x += 4) {
+            uint8_t *dst = dst_buf + (x_offset | y_offset) * bytes_per_pixel;
+            switch (bytes_per_pixel) {
+            case 1: swizzle_tile_8(src, row_pitch, dst, 4); break;
+            case 2: swizzle_tile_16(src, row_pitch, dst, 8); break;
+            case 4: swizzle_tile_32(src, row_pitch, dst); break;
+            default: assert(false); break;
+            }
+            src += 4 * bytes_per_pixel;
+            x_offset = swizzle_step(x_offset, tile_mask_x);
+        }
+        y_offset = swizzle_step(y_offset, tile_mask_y);
+    }
+}
+
+static inline __attribute__((always_inline)) void unswizzle_tiles(
+    const uint8_t *src_buf,
+    unsigned int width,
+    unsigned int height,
+    uint8_t *dst_buf,
+    unsigned int row_pitch,
+    uint32_t mask_x,
+    uint32_t mask_y,
     unsigned int bytes_per_pixel)
 {
-    return bytes_per_pixel * (fill_pattern(mask_x, x)
-                           | fill_pattern(mask_y, y)
-                           | fill_pattern(mask_z, z));
+    uint32_t tile_mask_x = tile_mask(mask_x);
+    uint32_t tile_mask_y = tile_mask(mask_y);
+
+    int x, y;
+    uint32_t y_offset = 0;
+    for (y = 0; y < height; y += 4) {
+        uint8_t *dst = dst_buf + y * row_pitch;
+        uint32_t x_offset = 0;
+        for (x = 0; x < width; x += 4) {
+            const uint8_t *src = src_buf + (x_offset | y_offset) * bytes_per_pixel;
+            switch (bytes_per_pixel) {
+            case 1: swizzle_tile_8(src, 4, dst, row_pitch); break;
+            case 2: swizzle_tile_16(src, 8, dst, row_pitch); break;
+            case 4: unswizzle_tile_32(src, dst, row_pitch); break;
+            default: assert(false); break;
+            }
+            dst += 4 * bytes_per_pixel;
+            x_offset = swizzle_step(x_offset, tile_mask_x);
+        }
+        y_offset = swizzle_step(y_offset, tile_mask_y);
+    }
 }
 
-void swizzle_box(
+static inline __attribute__((always_inline)) void swizzle_texels(
     const uint8_t *src_buf,
     unsigned int width,
     unsigned int height,
@@ -90,28 +273,30 @@ void swizzle_box(
     uint8_t *dst_buf,
     unsigned int row_pitch,
     unsigned int slice_pitch,
+    uint32_t mask_x,
+    uint32_t mask_y,
     unsigned int bytes_per_pixel)
 {
-    uint32_t mask_x, mask_y, mask_z;
-    generate_swizzle_masks(width, height, depth, &mask_x, &mask_y, &mask_z);
-
+    /* Every slice is written to the first slice of the destination */
     int x, y, z;
     for (z = 0; z < depth; z++) {
+        uint32_t y_offset = 0;
         for (y = 0; y < height; y++) {
+            const uint8_t *src = src_buf + y * row_pitch;
+            uint32_t x_offset = 0;
             for (x = 0; x < width; x++) {
-                const uint8_t *src = src_buf
-                                         + y * row_pitch + x * bytes_per_pixel;
-                uint8_t *dst = dst_buf + get_swizzled_offset(x, y, 0,
-                                                             mask_x, mask_y, 0,
-                                                             bytes_per_pixel);
+                uint8_t *dst = dst_buf + (x_offset | y_offset) * bytes_per_pixel;
                 memcpy(dst, src, bytes_per_pixel);
+                src += bytes_per_pixel;
+                x_offset = swizzle_step(x_offset, mask_x);
             }
+            y_offset = swizzle_step(y_offset, mask_y);
         }
         src_buf += slice_pitch;
     }
 }
 
-void unswizzle_box(
+static inline __attribute__((always_inline)) void unswizzle_texels(
     const uint8_t *src_buf,
     unsigned int width,
     unsigned int height,
@@ -119,26 +304,257 @@ void unswizzle_box(
     uint8_t *dst_buf,
     unsigned int row_pitch,
     unsigned int slice_pitch,
+    uint32_t mask_x,
+    uint32_t mask_y,
+    uint32_t mask_z,
     unsigned int bytes_per_pixel)
 {
-    uint32_t mask_x, mask_y, mask_z;
-    generate_swizzle_masks(width, height, depth, &mask_x, &mask_y, &mask_z);
-
     int x, y, z;
+    uint32_t z_offset = 0;
     for (z = 0; z < depth; z++) {
+        uint32_t y_offset = 0;
         for (y = 0; y < height; y++) {
+            uint8_t *dst = dst_buf + y * row_pitch;
+            uint32_t x_offset = 0;
             for (x = 0; x < width; x++) {
                 const uint8_t *src = src_buf
-                    + get_swizzled_offset(x, y, z, mask_x, mask_y, mask_z,
-                                          bytes_per_pixel);
-                uint8_t *dst = dst_buf + y * row_pitch + x * bytes_per_pixel;
+                    + (x_offset | y_offset | z_offset) * bytes_per_pixel;
                 memcpy(dst, src, bytes_per_pixel);
+                dst += bytes_per_pixel;
+                x_offset = swizzle_step(x_offset, mask_x);
             }
+            y_offset = swizzle_step(y_offset, mask_y);
         }
+        z_offset = swizzle_step(z_offset, mask_z);
         dst_buf += slice_pitch;
     }
 }
 
+void swizzle_box(
+    const uint8_t *src_buf,
+    unsigned int width,
+    unsigned int height,
+    unsigned int depth,
+    uint8_t *dst_buf,
+    unsigned int row_pitch,
+    unsigned int slice_pitch,
+    unsigned int bytes_per_pixel)
+{
+    uint32_t mask_x, mask_y, mask_z;
+    generate_swizzle_masks(width, height, depth, &mask_x, &mask_y, &mask_z);
+
+    if (is_tileable(width, height, depth)) {
+        switch (bytes_per_pixel) {
+        case 1:
+            swizzle_tiles(src_buf, width, height, dst_buf, row_pitch,
+                          mask_x, mask_y, 1);
+            return;
+        case 2:
+            swizzle_tiles(src_buf, width, height, dst_buf, row_pitch,
+                          mask_x, mask_y, 2);
+            return;
+        case 4:
+            swizzle_tiles(src_buf, width, height, dst_buf, row_pitch,
+                          mask_x, mask_y, 4);
+            return;
+        default:
+            break;
+        }
+    }
+
+    switch (bytes_per_pixel) {
+    case 1:
+        swizzle_texels(src_buf, width, height, depth, dst_buf,
+                       row_pitch, slice_pitch, mask_x, mask_y, 1);
+        break;
+    case 2:
+        swizzle_texels(src_buf, width, height, depth, dst_buf,
+                       row_pitch, slice_pitch, mask_x, mask_y, 2);
+        break;
+    case 4:
+        swizzle_texels(src_buf, width, height, depth, dst_buf,
+                       row_pitch, slice_pitch, mask_x, mask_y, 4);
+        break;
+    default:
+        swizzle_texels(src_buf, width, height, depth, dst_buf,
+                       row_pitch, slice_pitch, mask_x, mask_y,
+                       bytes_per_pixel);
+        break;
+    }
+}
+
+void unswizzle_box(
+    const uint8_t *src_buf,
+    unsigned int width,
+    unsigned int height,
+    unsigned int depth,
+    uint8_t *dst_buf,
+    unsigned int row_pitch,
+    unsigned int slice_pitch,
+    unsigned int bytes_per_pixel)
+{
+    uint32_t mask_x, mask_y, mask_z;
+    generate_swizzle_masks(width, height, depth, &mask_x, &mask_y, &mask_z);
+
+    if (is_tileable(width, height, depth)) {
+        switch (bytes_per_pixel) {
+        case 1:
+            unswizzle_tiles(src_buf, width, height, dst_buf, row_pitch,
+                            mask_x, mask_y, 1);
+            return;
+        case 2:
+            unswizzle_tiles(src_buf, width, height, dst_buf, row_pitch,
+                            mask_x, mask_y, 2);
+            return;
+        case 4:
+            unswizzle_tiles(src_buf, width, height, dst_buf, row_pitch,
+                            mask_x, mask_y, 4);
+            return;
+        default:
+            break;
+        }
+    }
+
+    switch (bytes_per_pixel) {
+    case 1:
+        unswizzle_texels(src_buf, width, height, depth, dst_buf,
+                         row_pitch, slice_pitch, mask_x, mask_y, mask_z, 1);
+        break;
+    case 2:
+        unswizzle_texels(src_buf, width, height, depth, dst_buf,
+                         row_pitch, slice_pitch, mask_x, mask_y, mask_z, 2);
+        break;
+    case 4:
+        unswizzle_texels(src_buf, width, height, depth, dst_buf,
+                         row_pitch, slice_pitch, mask_x, mask_y, mask_z, 4);
+        break;
+    default:
+        unswizzle_texels(src_buf, width, height, depth, dst_buf,
+                         row_pitch, slice_pitch, mask_x, mask_y, mask_z,
+                         bytes_per_pixel);
+        break;
+    }
+}
+
+static inline __attribute__((always_inline)) void swizzle_subrect_texels(
+    const uint8_t *src_buf,
+    unsigned int x,
+    unsigned int y,
+    unsigned int width,
+    unsigned int height,
+    uint8_t *dst_buf,
+    unsigned int pitch,
+    uint32_t mask_x,
+    uint32_t mask_y,
+    unsigned int bytes_per_pixel,
+    bool unswizzle)
+{
+    uint32_t x_start = fill_pattern(mask_x, x);
+    uint32_t y_offset = fill_pattern(mask_y, y);
+
+    int i, j;
+    for (j = 0; j < height; j++) {
+        uint8_t *linear = (uint8_t *)src_buf + j * pitch;
+        uint32_t x_offset = x_start;
+        for (i = 0; i < width; i++) {
+            uint8_t *swizzled = dst_buf + (x_offset | y_offset) * bytes_per_pixel;
+            if (unswizzle) {
+                memcpy(linear, swizzled, bytes_per_pixel);
+            } else {
+                memcpy(swizzled, linear, bytes_per_pixel);
+            }
+            linear += bytes_per_pixel;
+            x_offset = swizzle_step(x_offset, mask_x);
+        }
+        y_offset = swizzle_step(y_offset, mask_y);
+    }
+}
+
+static void swizzle_subrect_any(
+    const uint8_t *linear_buf,
+    unsigned int x,
+    unsigned int y,
+    unsigned int width,
+    unsigned int height,
+    uint8_t *swizzled_buf,
+    unsigned int pitch,
+    unsigned int swizzled_width,
+    unsigned int swizzled_height,
+    unsigned int bytes_per_pixel,
+    bool unswizzle)
+{
+    uint32_t mask_x, mask_y, mask_z;
+    generate_swizzle_masks(swizzled_width, swizzled_height, 1,
+                           &mask_x, &mask_y, &mask_z);
+
+    assert(x + width <= swizzled_width);
+    assert(y + height <= swizzled_height);
+
+    switch (bytes_per_pixel) {
+    case 1:
+        swizzle_subrect_texels(linear_buf, x, y, width, height, swizzled_buf,
+                               pitch, mask_x, mask_y, 1, unswizzle);
+        break;
+    case 2:
+        swizzle_subrect_texels(linear_buf, x, y, width, height, swizzled_buf,
+                               pitch, mask_x, mask_y, 2, unswizzle);
+        break;
+    case 4:
+        swizzle_subrect_texels(linear_buf, x, y, width, height, swizzled_buf,
+                               pitch, mask_x, mask_y, 4, unswizzle);
+        break;
+    default:
+        swizzle_subrect_texels(linear_buf, x, y, width, height, swizzled_buf,
+                               pitch, mask_x, mask_y, bytes_per_pixel,
+                               unswizzle);
+        break;
+    }
+}
+
+void swizzle_subrect(
+    const uint8_t *src_buf,
+    unsigned int x,
+    unsigned int y,
+    unsigned int width,
+    unsigned int height,
+    uint8_t *dst_buf,
+    unsigned int pitch,
+    unsigned int dst_width,
+    unsigned int dst_height,
+    unsigned int bytes_per_pixel)
+{
+    swizzle_subrect_any(src_buf, x, y, width, height, dst_buf, pitch,
+                        dst_width, dst_height, bytes_per_pixel, false);
+}
+
+void unswizzle_subrect(
+    const uint8_t *src_buf,
+    unsigned int x,
+    unsigned int y,
+    unsigned int width,
+    unsigned int height,
+    unsigned int src_width,
+    unsigned int src_height,
+    uint8_t *dst_buf,
+    unsigned int pitch,
+    unsigned int bytes_per_pixel)
+{
+    swizzle_subrect_any(dst_buf, x, y, width, height, (uint8_t *)src_buf,
+                        pitch, src_width, src_height, bytes_per_pixel, true);
+}
+
+unsigned int swizzle_rect_offset(
+    unsigned int x,
+    unsigned int y,
+    unsigned int width,
+    unsigned int height,
+    unsigned int bytes_per_pixel)
+{
+    uint32_t mask_x, mask_y, mask_z;
+    generate_swizzle_masks(width, height, 1, &mask_x, &mask_y, &mask_z);
+    return bytes_per_pixel * (fill_pattern(mask_x, x) | fill_pattern(mask_y, y));
+}
+
 void unswizzle_rect(
     const uint8_t *src_buf,
     unsigned int width,
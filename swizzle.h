@@ -60,4 +60,46 @@ void swizzle_rect(
     unsigned int pitch,
     unsigned int bytes_per_pixel);
 
+/* Writes a width x height rectangle of linear texels into the texels starting
+ * at (x, y) of a swizzled dst_width x dst_height image; the rest of the image
+ * is not touched.
+ */
+void swizzle_subrect(
+    const uint8_t *src_buf,
+    unsigned int x,
+    unsigned int y,
+    unsigned int width,
+    unsigned int height,
+    uint8_t *dst_buf,
+    unsigned int pitch,
+    unsigned int dst_width,
+    unsigned int dst_height,
+    unsigned int bytes_per_pixel);
+
+/* Reads the width x height rectangle at (x, y) of a swizzled
+ * src_width x src_height image into linear texels.
+ */
+void unswizzle_subrect(
+    const uint8_t *src_buf,
+    unsigned int x,
+    unsigned int y,
+    unsigned int width,
+    unsigned int height,
+    unsigned int src_width,
+    unsigned int src_height,
+    uint8_t *dst_buf,
+    unsigned int pitch,
+    unsigned int bytes_per_pixel);
+
+/* Returns the byte offset of texel (x, y) in a swizzled width x height image.
+ * An aligned square block of a power-of-two size which fits into the image
+ * is contiguous in memory and starts at the offset of its first texel.
+ */
+unsigned int swizzle_rect_offset(
+    unsigned int x,
+    unsigned int y,
+    unsigned int width,
+    unsigned int height,
+    unsigned int bytes_per_pixel);
+
 #endif